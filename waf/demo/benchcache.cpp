@@ -0,0 +1,151 @@
+/*
+block cache contention benchmark. every file of an archive is read once
+into a cache big enough to hold all of it, then 1, 2, 4, ... threads read
+the files over and over for a second each, so every block is a cache hit,
+and the hits per second are printed for each thread count, with the reads
+from the archive file. those stay at 0, but for the header of each constant
+block, which is never cached, and the chunk lists of chunked archives, which
+each open reads.
+
+build, after compiling the sources of ../wafexpc and ../zlib as C:
+	g++ -std=c++11 -O2 benchcache.cpp *.o -lpthread -o benchcache
+usage:
+	benchcache <archive> [max threads]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../wafexpc/wafexp.h"
+
+#define BENCH_CHUNK (64 * 1024)
+#define BENCH_SECONDS 1
+
+static std::atomic<bool> bench_stop;
+
+static size_t bench_read(waf_archive *arc, const std::string &name, std::vector<char> &buff)
+{
+	waf_file *fp = waf_open(arc, name.c_str());
+	waf_size_t size;
+	size_t bytes = 0;
+
+	if (!fp)
+		return 0;
+
+	do
+	{
+		size = BENCH_CHUNK;
+		if (waf_read(fp, &buff[0], &size) != 0)
+			break;
+		bytes += (size_t)size;
+	}
+	while (size == BENCH_CHUNK);
+
+	waf_close(fp);
+	return bytes;
+}
+
+/* reads whole files until stopped, each thread starting at a different one */
+static void bench_reader(waf_archive *arc, const std::vector<std::string> *names, size_t first, size_t *bytes)
+{
+	std::vector<char> buff(BENCH_CHUNK);
+	size_t i;
+
+	for (i = first; !bench_stop.load(std::memory_order_relaxed); i++)
+		*bytes += bench_read(arc, (*names)[i % names->size()], buff);
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> names;
+	waf_size_t total = 0;
+	unsigned threads, maxthreads = 2 * std::thread::hardware_concurrency();
+	waf_archive *arc;
+	waf_cache *cache;
+	waf_iter it;
+
+	if (argc < 2)
+	{
+		printf("usage: benchcache <archive> [max threads]\n");
+		return 1;
+	}
+	if (argc > 2)
+		maxthreads = (unsigned)atoi(argv[2]);
+
+	arc = waf_archive_open(argv[1], 0);
+	if (!arc || waf_list(arc, "", &it) != 0)
+	{
+		printf("can't open %s\n", argv[1]);
+		return 1;
+	}
+	while (waf_next(&it) == 0)
+	{
+		names.push_back(it.name);
+		total += it.size;
+	}
+	if (names.empty())
+	{
+		printf("nothing to read\n");
+		return 1;
+	}
+
+	/* room for every block twice over, so nothing is evicted */
+	cache = waf_cache_create(2 * total + 16 * 1024 * 1024);
+	if (!cache || waf_archive_set_cache(arc, cache) != 0)
+	{
+		printf("can't create the cache\n");
+		return 1;
+	}
+
+	{
+		std::vector<char> buff(BENCH_CHUNK);
+
+		for (size_t i = 0; i < names.size(); i++)
+			bench_read(arc, names[i], buff);
+	}
+
+	printf("threads      hits/s   hit rate       MB/s   io reads\n");
+	for (threads = 1; threads <= maxthreads; threads *= 2)
+	{
+		std::vector<std::thread> readers;
+		std::vector<size_t> bytes(threads * 16, 0);  /* a cache line apart */
+		waf_stats before, after;
+		size_t sum = 0;
+		double secs;
+
+		waf_archive_stats(&before);
+		bench_stop = false;
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned t = 0; t < threads; t++)
+			readers.emplace_back(bench_reader, arc, &names, t * names.size() / threads, &bytes[t * 16]);
+
+		std::this_thread::sleep_for(std::chrono::seconds(BENCH_SECONDS));
+		bench_stop = true;
+		for (auto &r : readers)
+			r.join();
+		secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		waf_archive_stats(&after);
+		for (unsigned t = 0; t < threads; t++)
+			sum += bytes[t * 16];
+
+		{
+			double hits = (double)(after.cache_hits - before.cache_hits);
+			double misses = (double)(after.cache_misses - before.cache_misses);
+
+			printf("%7u %11.0f %9.1f%% %10.1f %10.0f\n", threads, hits / secs,
+				hits + misses > 0 ? 100 * hits / (hits + misses) : 0.0, sum / secs / (1024 * 1024),
+				(double)(after.io_reads - before.io_reads));
+		}
+	}
+
+	waf_archive_close(arc);
+	waf_cache_destroy(cache);
+
+	return 0;
+}
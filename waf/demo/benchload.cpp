@@ -0,0 +1,215 @@
+/*
+coroutine loading benchmark. starts 10000 loads (or the count given) at
+once through waf::load, cycling over the files of an archive, and resumes
+them on a small executor. the same loads are then run one after another
+with waf_open and waf_read on a single thread for comparison. the archive
+is read once before timing, so both runs come from the page cache.
+
+build (linux), after compiling the sources of ../wafexpc and ../zlib as C:
+	g++ -std=c++20 -O2 benchload.cpp *.o -lpthread -o benchload
+usage:
+	benchload <archive> [loads] [executor threads]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include "../wafexpc/wafcoro.h"
+
+/* resumes coroutines on its own threads, as a job system would */
+class bench_executor : public waf::executor
+{
+public:
+	explicit bench_executor(unsigned threads) : _stop(false)
+	{
+		for (unsigned i = 0; i < threads; i++)
+			_threads.emplace_back([this] { run(); });
+	}
+
+	~bench_executor()
+	{
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			_stop = true;
+		}
+		_cond.notify_all();
+		for (auto &t : _threads)
+			t.join();
+	}
+
+	void post(std::coroutine_handle<> handle) override
+	{
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			_queue.push_back(handle);
+		}
+		_cond.notify_one();
+	}
+
+private:
+	void run()
+	{
+		for (;;)
+		{
+			std::unique_lock<std::mutex> guard(_lock);
+			_cond.wait(guard, [this] { return _stop || !_queue.empty(); });
+			if (_queue.empty())
+				return;
+
+			std::coroutine_handle<> handle = _queue.front();
+			_queue.pop_front();
+			guard.unlock();
+			handle.resume();
+		}
+	}
+
+	std::mutex _lock;
+	std::condition_variable _cond;
+	std::deque<std::coroutine_handle<> > _queue;
+	std::vector<std::thread> _threads;
+	bool _stop;
+};
+
+/* counts finished loads, main waits until all have */
+struct bench_state
+{
+	std::atomic<size_t> bytes{0};
+	std::atomic<size_t> failed{0};
+	size_t left;
+	std::mutex lock;
+	std::condition_variable cond;
+
+	void finish()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (--left == 0)
+			cond.notify_one();
+	}
+};
+
+/* a coroutine nobody awaits, it runs until its load completes */
+struct bench_detached
+{
+	struct promise_type
+	{
+		bench_detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+static bench_detached bench_load(waf_archive *arc, const char *filename, waf::executor *exec, bench_state *state)
+{
+	try
+	{
+		waf::buffer data = co_await waf::load(arc, filename, exec);
+		state->bytes += data.size();
+	}
+	catch (const std::exception&)
+	{
+		state->failed++;
+	}
+
+	state->finish();
+}
+
+static double bench_seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static size_t bench_blocking(waf_archive *arc, const std::vector<std::string> &names, size_t loads)
+{
+	std::vector<char> buff;
+	size_t total = 0;
+
+	for (size_t i = 0; i < loads; i++)
+	{
+		waf_file *fp = waf_open(arc, names[i % names.size()].c_str());
+		waf_size_t size;
+
+		if (!fp)
+			continue;
+
+		size = waf_size(fp);
+		buff.resize((size_t)size + 1);
+		if (waf_read(fp, buff.data(), &size) == 0)
+			total += (size_t)size;
+		waf_close(fp);
+	}
+
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> names;
+	size_t loads = 10000;
+	unsigned threads = 4;
+	waf_archive *arc;
+	waf_iter it;
+
+	if (argc < 2)
+	{
+		printf("usage: benchload <archive> [loads] [executor threads]\n");
+		return 1;
+	}
+	if (argc > 2)
+		loads = (size_t)atol(argv[2]);
+	if (argc > 3)
+		threads = (unsigned)atoi(argv[3]);
+
+	arc = waf_archive_open(argv[1], 0);
+	if (!arc || waf_list(arc, "", &it) != 0)
+	{
+		printf("can't open %s\n", argv[1]);
+		return 1;
+	}
+	while (waf_next(&it) == 0)
+		names.push_back(it.name);
+	if (names.empty() || loads == 0)
+	{
+		printf("nothing to load\n");
+		return 1;
+	}
+
+	waf_async_start(0);
+	bench_blocking(arc, names, names.size());
+
+	{
+		bench_executor exec(threads);
+		bench_state state;
+		auto start = std::chrono::steady_clock::now();
+
+		state.left = loads;
+		for (size_t i = 0; i < loads; i++)
+			bench_load(arc, names[i % names.size()].c_str(), &exec, &state);
+
+		std::unique_lock<std::mutex> guard(state.lock);
+		state.cond.wait(guard, [&] { return state.left == 0; });
+
+		double secs = bench_seconds(start);
+		printf("coroutines  %zu loads of %zu files, %zu failed: %.3f s, %.0f files/s, %.1f MB/s\n",
+			loads, names.size(), (size_t)state.failed, secs, loads / secs, state.bytes / secs / (1024 * 1024));
+	}
+
+	{
+		auto start = std::chrono::steady_clock::now();
+		size_t bytes = bench_blocking(arc, names, loads);
+		double secs = bench_seconds(start);
+
+		printf("blocking    %zu loads of %zu files: %.3f s, %.0f files/s, %.1f MB/s\n",
+			loads, names.size(), secs, loads / secs, bytes / secs / (1024 * 1024));
+	}
+
+	waf_async_stop();
+	waf_archive_close(arc);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+queue depth benchmark. reads every file of an archive with a fixed number
+of async requests in flight, once from a stdio source and once from an
+io_uring source, and prints the throughput of both at each depth. the
+archive is dropped from the page cache before every run, so put it on the
+drive being measured.
+
+build (linux), after compiling the sources of ../wafexpc and ../zlib as C:
+	g++ -O2 benchqd.cpp *.o -lpthread -o benchqd
+usage:
+	benchqd <archive> [max depth]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../wafexpc/wafexp.h"
+
+#define BENCH_CHUNK (1024 * 1024)
+
+struct bench_slot
+{
+	waf_request *req;
+	char *buff;
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_evict(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+
+	if (fd >= 0)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/* returns MB/s, or a negative value if a read failed */
+static double bench_run(const char *filename, int uring, unsigned depth)
+{
+	waf_archive *arc;
+	bench_slot *slots;
+	waf_size_t count, id, offset = 0, total = 0;
+	unsigned i, n = 0;
+	int failed = 0;
+	double start;
+
+	bench_evict(filename);
+	arc = uring ? waf_archive_open_uring(filename, 0) : waf_archive_open(filename, 0);
+	if (!arc)
+		return -1;
+
+	slots = new bench_slot[depth];
+	for (i = 0; i < depth; i++)
+	{
+		slots[i].req = NULL;
+		slots[i].buff = new char[BENCH_CHUNK];
+	}
+
+	waf_async_start(depth);
+	count = waf_count(arc);
+	start = bench_now();
+
+	/* one chunk per request, the oldest is waited for once every slot is busy */
+	for (id = 0; id < count; )
+	{
+		waf_size_t size = waf_size_id(arc, id);
+		waf_size_t len = size - offset < BENCH_CHUNK ? size - offset : BENCH_CHUNK;
+		bench_slot *slot = &slots[n++ % depth];
+
+		if (slot->req)
+		{
+			waf_size_t got;
+
+			if (waf_request_wait(slot->req, &got) != 0)
+				failed = 1;
+			total += got;
+			waf_request_release(slot->req);
+			slot->req = NULL;
+		}
+
+		if (len > 0)
+		{
+			slot->req = waf_read_async(arc, id, offset, slot->buff, len, WAF_PRIORITY_NORMAL, NULL, NULL);
+			if (!slot->req)
+				failed = 1;
+		}
+
+		offset += len;
+		if (offset >= size)
+		{
+			offset = 0;
+			id++;
+		}
+	}
+
+	for (i = 0; i < depth; i++)
+	{
+		if (slots[i].req)
+		{
+			waf_size_t got;
+
+			if (waf_request_wait(slots[i].req, &got) != 0)
+				failed = 1;
+			total += got;
+			waf_request_release(slots[i].req);
+		}
+		delete[] slots[i].buff;
+	}
+	delete[] slots;
+
+	start = bench_now() - start;
+	waf_async_stop();
+	waf_archive_close(arc);
+
+	return failed ? -1 : total / start / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned depth, maxdepth = 64;
+
+	if (argc < 2)
+	{
+		printf("usage: benchqd <archive> [max depth]\n");
+		return 1;
+	}
+	if (argc > 2)
+		maxdepth = (unsigned)atoi(argv[2]);
+
+	printf("depth      stdio MB/s   io_uring MB/s\n");
+	for (depth = 1; depth <= maxdepth; depth *= 2)
+	{
+		double plain = bench_run(argv[1], 0, depth);
+		double uring = bench_run(argv[1], 1, depth);
+
+		if (plain < 0 || uring < 0)
+		{
+			printf("can't read %s\n", argv[1]);
+			return 1;
+		}
+		printf("%5u   %12.1f   %13.1f\n", depth, plain, uring);
+	}
+
+	return 0;
+}
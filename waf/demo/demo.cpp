@@ -21,7 +21,7 @@ int main(void)
 			waf_read(fp, buf, &size);
 			buf[size] = '\0';
 
-			printf("Read %d bytes.\n", size);
+			printf("Read %lu bytes.\n", (unsigned long)size);
 			printf("%s\n", buf);
 
 			waf_close(fp);
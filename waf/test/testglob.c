@@ -0,0 +1,132 @@
+/*
+glob test. writes a small source tree, which the archive is built from,
+then checks what waf_glob lists for a set of patterns, '**' in particular.
+
+	testglob make globdata
+	waf globdata glob.waf
+	testglob check glob.waf
+
+build, after compiling the sources of ../wafexpc and ../zlib as C:
+	gcc -O2 testglob.c *.o -lpthread -o testglob
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define TEST_MKDIR(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define TEST_MKDIR(path) mkdir((path), 0755)
+#endif
+
+#include "../wafexpc/wafexp.h"
+
+static const char *test_dirs[] =
+{
+	"", "/a", "/a/x", "/a/x/y", "/ab", NULL
+};
+
+static const char *test_files[] =
+{
+	"a/b.txt", "a/c.txt", "a/x/b.txt", "a/x/y/b.txt", "a/xb.txt", "ab/b.txt", "b.txt", NULL
+};
+
+/* pattern and the names it lists, in sorted order */
+static const char *test_cases[][2] =
+{
+	{ "a/**/b.txt", "a/b.txt a/x/b.txt a/x/y/b.txt" },
+	{ "**/b.txt", "a/b.txt a/x/b.txt a/x/y/b.txt ab/b.txt b.txt" },
+	{ "a/**", "a/b.txt a/c.txt a/x/b.txt a/x/y/b.txt a/xb.txt" },
+	{ "a/x/**/y/b.txt", "a/x/y/b.txt" },
+	{ "a/**/x/**/b.txt", "a/x/b.txt a/x/y/b.txt" },
+	{ "a/x**/b.txt", "a/x/b.txt a/x/y/b.txt" },  /* not a whole component, needs a directory */
+	{ "a/**b.txt", "a/b.txt a/x/b.txt a/x/y/b.txt a/xb.txt" },
+	{ "a/*.txt", "a/b.txt a/c.txt a/xb.txt" },
+	{ "a/*/b.txt", "a/x/b.txt" },
+	{ "?/b.txt", "a/b.txt" },
+	{ "a/[!b].txt", "a/c.txt" },
+	{ "b.txt", "b.txt" },
+	{ "c/**/b.txt", "" },
+	{ NULL, NULL }
+};
+
+static int test_make(const char *dir)
+{
+	char path[260];
+	FILE *fp;
+	int i;
+
+	for (i = 0; test_dirs[i]; i++)
+	{
+		sprintf(path, "%s%s", dir, test_dirs[i]);
+		TEST_MKDIR(path);
+	}
+
+	for (i = 0; test_files[i]; i++)
+	{
+		sprintf(path, "%s/%s", dir, test_files[i]);
+		fp = fopen(path, "wb");
+		if (!fp || fputs(test_files[i], fp) < 0)
+		{
+			printf("can't write %s\n", path);
+			return 1;
+		}
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+static int test_run(const char *filename)
+{
+	waf_archive *arc;
+	waf_iter it;
+	char listed[1024];
+	int failed = 0;
+	int i;
+
+	arc = waf_archive_open(filename, 0);
+	if (!arc)
+	{
+		printf("can't open %s\n", filename);
+		return 1;
+	}
+
+	for (i = 0; test_cases[i][0]; i++)
+	{
+		listed[0] = 0;
+		if (waf_glob(arc, test_cases[i][0], &it) == 0)
+		{
+			while (waf_next(&it) == 0)
+			{
+				if (listed[0])
+					strcat(listed, " ");
+				strcat(listed, it.name);
+			}
+		}
+
+		if (strcmp(listed, test_cases[i][1]) != 0)
+		{
+			printf("FAILED: %s lists \"%s\", not \"%s\"\n", test_cases[i][0], listed, test_cases[i][1]);
+			failed = 1;
+		}
+	}
+
+	waf_archive_close(arc);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 3 && strcmp(argv[1], "make") == 0)
+		return test_make(argv[2]);
+	if (argc == 3 && strcmp(argv[1], "check") == 0)
+		return test_run(argv[2]);
+
+	printf("usage: testglob make <dir> | check <archive>\n");
+	return 1;
+}
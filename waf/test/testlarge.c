@@ -0,0 +1,268 @@
+/*
+large file test. writes a sparse source directory holding a file over 4 GB,
+which the archive is built from, then checks reads and seeks past 4 GB in
+the archive, and opening it at an offset past 4 GB in a sparse host file.
+the sparse files take a few kilobytes of disk.
+
+	testlarge make largedata
+	waf largedata large.waf
+	testlarge check large.waf
+
+build, after compiling the sources of ../wafexpc and ../zlib as C:
+	gcc -O2 testlarge.c *.o -lpthread -o testlarge
+*/
+
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#include <direct.h>
+#define TEST_MKDIR(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define TEST_MKDIR(path) mkdir((path), 0755)
+#endif
+
+#include "../wafexpc/wafexp.h"
+#include "../wafexpc/wafconf.h"
+
+#define TEST_BIG_SIZE ((waf_size_t)0x100030005ULL)  /* 4 GB and a bit, not a block multiple */
+#define TEST_EMBED ((waf_size_t)0x14000007bULL)  /* host offset of the embedded archive, 5 GB and 123 */
+#define TEST_MARK_SIZE 16
+#define TEST_MARKS 3
+#define TEST_SMALL "after the big file\n"
+
+static const waf_size_t test_marks[TEST_MARKS] =
+{
+	0,
+	(waf_size_t)0xfffffff8UL,  /* across the 4 GB boundary */
+	TEST_BIG_SIZE - TEST_MARK_SIZE
+};
+
+static int test_failed = 0;
+
+static void test_check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		printf("FAILED: %s\n", what);
+		test_failed = 1;
+	}
+}
+
+static void test_mark(int index, char *mark)
+{
+	sprintf(mark, "<mark %d ~~~~~~~", index);
+	mark[TEST_MARK_SIZE - 1] = '>';
+}
+
+/* create an empty file that takes no disk for the ranges never written */
+static FILE* test_create_sparse(const char *filename)
+{
+#ifdef _WIN32
+	HANDLE h;
+	DWORD bytes;
+
+	h = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return NULL;
+	DeviceIoControl(h, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+	CloseHandle(h);
+
+	return fopen(filename, "r+b");
+#else
+	return fopen(filename, "wb");
+#endif
+}
+
+static int test_write_at(FILE *fp, waf_size_t pos, const void *data, size_t size)
+{
+	if (WAF_FSEEK(fp, pos, SEEK_SET) != 0 || fwrite(data, 1, size, fp) != size)
+		return -1;
+	return 0;
+}
+
+static int test_make(const char *dir)
+{
+	char path[260];
+	char mark[TEST_MARK_SIZE + 1];
+	FILE *fp;
+	int i;
+
+	TEST_MKDIR(dir);
+
+	sprintf(path, "%s/big.bin", dir);
+	fp = test_create_sparse(path);
+	if (!fp)
+	{
+		printf("can't create %s\n", path);
+		return 1;
+	}
+	for (i = 0; i < TEST_MARKS; i++)
+	{
+		test_mark(i, mark);
+		if (test_write_at(fp, test_marks[i], mark, TEST_MARK_SIZE) != 0)
+		{
+			printf("can't write %s\n", path);
+			fclose(fp);
+			return 1;
+		}
+	}
+	fclose(fp);
+
+	sprintf(path, "%s/small.txt", dir);
+	fp = fopen(path, "wb");
+	if (!fp || fputs(TEST_SMALL, fp) < 0)
+	{
+		printf("can't write %s\n", path);
+		return 1;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static void test_read_at(waf_file *fp, waf_off_t offset, int origin, waf_size_t expected, const char *data, const char *what)
+{
+	char buff[TEST_MARK_SIZE];
+	waf_size_t size = TEST_MARK_SIZE;
+
+	test_check(waf_seek(fp, offset, origin) == 0, what);
+	test_check(waf_tell(fp) == expected, what);
+	test_check(waf_read(fp, buff, &size) >= 0 && size == TEST_MARK_SIZE, what);
+	test_check(memcmp(buff, data, TEST_MARK_SIZE) == 0, what);
+	test_check(waf_tell(fp) == expected + TEST_MARK_SIZE, what);
+}
+
+static void test_archive(waf_archive *arc, const char *name)
+{
+	char mark[TEST_MARK_SIZE + 1];
+	char zero[TEST_MARK_SIZE];
+	char buff[sizeof(TEST_SMALL)];
+	waf_size_t id, size;
+	waf_file *fp;
+	int i;
+
+	printf("%s\n", name);
+	if (!arc)
+	{
+		test_check(0, "open the archive");
+		return;
+	}
+
+	id = waf_find(arc, "big.bin");
+	test_check(id != WAF_NO_ID && waf_size_id(arc, id) == TEST_BIG_SIZE, "big.bin size by id");
+
+	fp = waf_open(arc, "big.bin");
+	test_check(fp != NULL, "open big.bin");
+	if (fp)
+	{
+		test_check(waf_size(fp) == TEST_BIG_SIZE, "big.bin size");
+
+		for (i = 0; i < TEST_MARKS; i++)
+		{
+			test_mark(i, mark);
+			test_read_at(fp, (waf_off_t)test_marks[i], SEEK_SET, test_marks[i], mark, "mark from the start");
+		}
+
+		/* backwards across 4 GB from the end and from the current position */
+		test_read_at(fp, -(waf_off_t)TEST_MARK_SIZE, SEEK_END, test_marks[2], mark, "mark from the end");
+		test_mark(1, mark);
+		test_read_at(fp, (waf_off_t)test_marks[1] - (waf_off_t)TEST_BIG_SIZE, SEEK_CUR, test_marks[1], mark, "mark from the current position");
+
+		memset(zero, 0, sizeof(zero));
+		test_read_at(fp, (waf_off_t)0x100010000ULL, SEEK_SET, (waf_size_t)0x100010000ULL, zero, "zeros past 4 GB");
+
+		size = TEST_MARK_SIZE;
+		test_check(waf_seek(fp, 0, SEEK_END) == 0 && waf_read(fp, mark, &size) == 1 && size == 0, "end of file");
+		test_check(waf_seek(fp, 1, SEEK_END) == 0 && waf_tell(fp) == TEST_BIG_SIZE, "seek past the end stops at the end");
+
+		waf_close(fp);
+	}
+
+	fp = waf_open(arc, "small.txt");
+	test_check(fp != NULL, "open small.txt");
+	if (fp)
+	{
+		size = sizeof(buff);
+		test_check(waf_read(fp, buff, &size) >= 0 && size == strlen(TEST_SMALL) && memcmp(buff, TEST_SMALL, (size_t)size) == 0, "small.txt");
+		waf_close(fp);
+	}
+
+	waf_archive_close(arc);
+}
+
+/* copy the archive into a sparse host file at TEST_EMBED */
+static int test_embed(const char *filename, const char *host)
+{
+	char buff[65536];
+	waf_size_t pos = TEST_EMBED;
+	FILE *src, *dst;
+	size_t size;
+	int ret = 0;
+
+	src = fopen(filename, "rb");
+	if (!src)
+		return -1;
+	dst = test_create_sparse(host);
+	if (!dst)
+	{
+		fclose(src);
+		return -1;
+	}
+
+	while ((size = fread(buff, 1, sizeof(buff), src)) > 0)
+	{
+		if (test_write_at(dst, pos, buff, size) != 0)
+		{
+			ret = -1;
+			break;
+		}
+		pos += size;
+	}
+
+	fclose(src);
+	fclose(dst);
+
+	return ret;
+}
+
+static int test_run(const char *filename)
+{
+	char host[260];
+
+	test_archive(waf_archive_open(filename, 0), "archive");
+	test_archive(waf_archive_open_uring(filename, 0), "archive, batched reads");
+
+	sprintf(host, "%s.host", filename);
+	if (test_embed(filename, host) != 0)
+		test_check(0, "write the host file");
+	else
+	{
+		test_archive(waf_archive_open(host, TEST_EMBED), "archive past 4 GB in a host file");
+		test_archive(waf_archive_open_uring(host, TEST_EMBED), "archive past 4 GB in a host file, batched reads");
+	}
+	remove(host);
+
+	printf(test_failed ? "FAILED\n" : "OK\n");
+	return test_failed;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 3 && strcmp(argv[1], "make") == 0)
+		return test_make(argv[2]);
+	if (argc == 3 && strcmp(argv[1], "check") == 0)
+		return test_run(argv[2]);
+
+	printf("usage: testlarge make <dir> | check <archive>\n");
+	return 1;
+}
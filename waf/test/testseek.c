@@ -0,0 +1,184 @@
+/*
+seek test. reads every file of an archive at random positions, many of them
+running into the end of the file before seeking back, and compares the data
+with a whole read of the file. the reads run without a cache, then with each
+kind of cache attached, so blocks come from the cache as well as the source.
+
+	testseek demodata.waf
+
+build, after compiling the sources of ../wafexpc and ../zlib as C:
+	gcc -O2 testseek.c *.o -lpthread -o testseek
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wafexpc/wafexp.h"
+
+#define TEST_SEEKS 200
+#define TEST_CACHE_SIZE (64 * 1024 * 1024)
+
+static unsigned long test_seed = 1;
+
+static waf_size_t test_random(waf_size_t range)
+{
+	test_seed = test_seed * 1103515245 + 12345;
+	return range ? (waf_size_t)((test_seed >> 8) % range) : 0;
+}
+
+/* seek and read over one file, returns the number of mismatched reads */
+static int test_file(waf_archive *arc, waf_size_t id, const unsigned char *whole, waf_size_t size)
+{
+	unsigned char *buff;
+	waf_file *fp;
+	int bad = 0;
+	int i;
+
+	fp = waf_open_id(arc, id);
+	buff = (unsigned char*)malloc((size_t)size + 2000);
+	if (!fp || !buff)
+	{
+		waf_close(fp);
+		free(buff);
+		return 1;
+	}
+
+	for (i = 0; i < TEST_SEEKS; i++)
+	{
+		waf_size_t pos;
+		waf_size_t len;
+		waf_size_t want;
+		int status;
+
+		/* every other read starts near the end and runs into it */
+		if (i & 1)
+		{
+			pos = size - test_random(size < 64 ? size + 1 : 64);
+			len = 2000;
+		}
+		else
+		{
+			pos = test_random(size + 1);
+			len = 1 + test_random(i % 8 == 0 ? 300000 : 200);
+		}
+
+		want = len < size - pos ? len : size - pos;
+
+		if (waf_seek(fp, (waf_off_t)pos, SEEK_SET) != 0 || waf_tell(fp) != pos)
+		{
+			bad++;
+			continue;
+		}
+
+		status = waf_read(fp, buff, &len);
+		if (status < 0 || len != want || memcmp(buff, whole + pos, (size_t)want) != 0)
+			bad++;
+	}
+
+	waf_close(fp);
+	free(buff);
+
+	return bad;
+}
+
+/* every file of the archive, read through cache if it is not NULL */
+static int test_archive(const char *filename, waf_cache *cache, const char *name)
+{
+	waf_archive *arc;
+	waf_archive *ref;
+	waf_size_t count;
+	waf_size_t id;
+	int pass;
+	int bad = 0;
+
+	arc = waf_archive_open(filename, 0);
+	ref = waf_archive_open(filename, 0);
+	if (!arc || !ref)
+	{
+		printf("%s: can't open %s\n", name, filename);
+		waf_archive_close(arc);
+		waf_archive_close(ref);
+		return 1;
+	}
+
+	/* shared caches key blocks by digest, which older archives don't have */
+	if (cache && waf_archive_set_cache(arc, cache) != 0)
+	{
+		printf("%s: skipped, the archive can't use it\n", name);
+		waf_archive_close(arc);
+		waf_archive_close(ref);
+		return 0;
+	}
+
+	count = waf_count(ref);
+
+	/* the second pass finds the blocks the first one cached */
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (id = 0; id < count; id++)
+		{
+			waf_size_t size = waf_size_id(ref, id);
+			unsigned char *whole = (unsigned char*)malloc((size_t)size + 1);
+			waf_file *fp = waf_open_id(ref, id);
+			waf_size_t got = size;
+
+			if (!whole || !fp || waf_read(fp, whole, &got) < 0 || got != size)
+				bad++;
+			else
+				bad += test_file(arc, id, whole, size);
+
+			waf_close(fp);
+			free(whole);
+		}
+	}
+
+	waf_archive_close(arc);
+	waf_archive_close(ref);
+
+	printf("%s: %d bad reads\n", name, bad);
+	return bad != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	waf_cache *cache;
+	int failed = 0;
+
+	if (argc != 2)
+	{
+		printf("usage: testseek <archive>\n");
+		return 1;
+	}
+
+	failed |= test_archive(argv[1], NULL, "no cache");
+
+	cache = waf_cache_create(TEST_CACHE_SIZE);
+	failed |= test_archive(argv[1], cache, "cache");
+	waf_cache_destroy(cache);
+
+	cache = waf_cache_create_tiered(TEST_CACHE_SIZE);
+	failed |= test_archive(argv[1], cache, "tiered cache");
+	waf_cache_destroy(cache);
+
+#ifndef _WIN32
+	waf_cache_unlink_shared("/waf-testseek");
+	cache = waf_cache_open_shared("/waf-testseek", TEST_CACHE_SIZE);
+	if (cache)
+	{
+		failed |= test_archive(argv[1], cache, "shared cache");
+		waf_cache_destroy(cache);
+		waf_cache_unlink_shared("/waf-testseek");
+	}
+
+	cache = waf_cache_open_dir("testseek.cache", TEST_CACHE_SIZE);
+	if (cache)
+	{
+		failed |= test_archive(argv[1], cache, "cache directory");
+		waf_cache_destroy(cache);
+	}
+#endif
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
@@ -31,9 +31,12 @@ distribution.
 
 #include <string>
 #include <list>
+#include <map>
+#include <set>
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <queue>
 #include <stdexcept>
 
 using namespace std;
@@ -43,8 +46,13 @@ using namespace std;
 struct archive_info
 {
 	vector<string> filename;
-	DWORD size;
-	DWORD offset;
+	ULONGLONG size;
+	ULONGLONG offset;
+	ULONGLONG extent;  // compressed bytes from offset to the end of the file's data
+	DWORD ref;  // data record in the index, records follow the archive order
+
+	archive_info *base;  // file this one is stored as a delta against
+	double access;  // first read in the access trace, in microseconds, -1 if never read
 
 	unsigned char md5[16];  // md5 value used to eliminate duplicated files
 };
@@ -53,8 +61,61 @@ enum
 {
 	waf_src_size = 64 * 1024,
 	waf_raw_size = 68 * 1024,
+
+	waf_dict_size = 32 * 1024,  // same as the deflate window
+	waf_dict_sample = 4 * 1024,  // bytes sampled from the head of each file
+	waf_dict_budget = 8 * 1024 * 1024,  // total bytes sampled
+	waf_dict_segment = 64,  // dictionary is assembled from segments of this size
+	waf_dict_gram = 8,
+	waf_dict_hashbits = 20,
+
+	waf_chunk_min = 4 * 1024,
+	waf_chunk_max = waf_src_size,
+
+	waf_delta_window = 16,  // bytes hashed to find a match in the base file
+	waf_delta_minmatch = 32,
+	waf_delta_hashbits = 20,
+	waf_delta_max_file = 64 * 1024 * 1024,  // base and variant are held in memory
+	waf_sketch_size = 64,
+};
+
+// delta block instructions
+enum
+{
+	waf_delta_copy = 'c',  // [position][length] from the base file
+	waf_delta_add = 'a',  // [length][data]
+};
+
+// block types, stored in the high bits of the block size
+static const DWORD waf_block_delta = 0x80000000;
+static const DWORD waf_block_fill = 0x40000000;  // low byte is the fill value, no data follows
+
+// 14 boundary bits, about 16 KB chunks on average
+static const DWORD waf_chunk_mask = 0xfffc0000;
+
+// archive flags, stored in the last byte of the signature
+enum
+{
+	waf_flag_dict = 0x01,
+	waf_flag_chunks = 0x02,
+	waf_flag_delta = 0x04,
+	waf_flag_extent = 0x08,
+	waf_flag_trailer = 0x10,
+	waf_flag_large = 0x20,
+	waf_flag_index = 0x40,
+	waf_flag_digest = 0x80,
 };
 
+// the last bytes of an archive: index offset, index size and this tag
+static const DWORD waf_trailer_signature = 0x65666177;  // "wafe"
+
+// packed index: about 4 names per hash bucket, give up after this many displacements
+static const DWORD waf_index_bucket = 4;
+static const DWORD waf_index_tries = 1 << 24;
+static const DWORD waf_restart_interval = 16;  // every 16th name is stored whole
+static const DWORD waf_max_name = 259;  // reader limit
+
+
 typedef list<archive_info*> waf_archive;
 
 static waf_archive _waf_info;
@@ -64,6 +125,20 @@ static string _srcdir;
 static string _outname;
 static string _pathadd;
 static bool _include_hidden = false;
+static bool _use_dict = false;
+static bool _use_chunks = false;
+static bool _use_delta = false;
+static string _idheader;
+static string _tracefile;
+
+// progress messages go to stderr when the archive is written to stdout
+static FILE *_msg = stdout;
+
+// bytes written to the archive so far, the output may not be seekable
+static ULONGLONG _outpos = 0;
+
+// preset dictionary shared by all blocks
+static string _dict;
 
 struct md5_context
 {
@@ -82,6 +157,9 @@ static MD5INITPROC md5_init;
 static MD5UPDATEPROC md5_update;
 static MD5FINALPROC md5_final;
 
+// digest of everything written to the archive, readers tell builds apart by it
+static md5_context _outmd5;
+
 bool md5_initsys(void)
 {
 	md5lib = LoadLibrary("Cryptdll.dll");
@@ -264,6 +342,10 @@ void scandir(const string &root, const string &sub)
 					inf->filename.push_back(found);
 					inf->size = 0;
 					inf->offset = 0;
+					inf->extent = 0;
+					inf->ref = 0;
+					inf->base = NULL;
+					inf->access = -1;
 					memcpy(inf->md5, finder.md5, 16);
 
 					_waf_info.push_back(inf);
@@ -279,39 +361,884 @@ void scandir(const string &root, const string &sub)
 	}
 }
 
-void waf_saveinfo(HANDLE hFile, archive_info *inf)
+// files read first come first, the trace lines are "<time> <position> <bytes> <name>" as
+// recorded by waf_archive_record, files never read keep their directory order at the end
+bool access_before(const archive_info *a, const archive_info *b)
+{
+	if (a->access < 0 || b->access < 0)
+		return a->access >= 0 && b->access < 0;
+
+	return a->access < b->access;
+}
+
+void waf_apply_trace(void)
+{
+	FILE *fp = fopen(_tracefile.c_str(), "r");
+	if (!fp)
+		throw runtime_error("Can't open access trace '" + _tracefile + "'.");
+
+	map<string, double> first;
+	char line[64 + waf_max_name + 2];
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		double time;
+		int name = 0;
+
+		if (sscanf(line, "%lf %*s %*s %n", &time, &name) < 1 || name == 0)
+			continue;
+
+		string filename(line + name);
+		while (!filename.empty() && (filename[filename.length() - 1] == '\n' || filename[filename.length() - 1] == '\r'))
+			filename.erase(filename.length() - 1);
+
+		// the reader sees the names with the added path
+		if (filename.compare(0, _pathadd.length(), _pathadd) != 0)
+			continue;
+		filename.erase(0, _pathadd.length());
+
+		map<string, double>::iterator found = first.find(filename);
+		if (found == first.end())
+			first[filename] = time;
+		else if (time < found->second)
+			found->second = time;
+	}
+
+	fclose(fp);
+
+	DWORD traced = 0;
+
+	for (waf_archive::iterator it = _waf_info.begin(); it != _waf_info.end(); ++it)
+	{
+		archive_info *inf = *it;
+
+		// duplicates are stored once, at the first read of any of their names
+		for (vector<string>::iterator name = inf->filename.begin(); name != inf->filename.end(); ++name)
+		{
+			map<string, double>::iterator found = first.find(*name);
+			if (found != first.end() && (inf->access < 0 || found->second < inf->access))
+				inf->access = found->second;
+		}
+
+		if (inf->access >= 0)
+			traced++;
+	}
+
+	// list sort is stable, untraced files stay in directory order
+	_waf_info.sort(access_before);
+
+	fprintf(_msg, "%u files laid out in the order of the access trace.\n", traced);
+}
+
+ULONGLONG file_size(HANDLE fp)
+{
+	LARGE_INTEGER size;
+
+	if (!GetFileSizeEx(fp, &size))
+		throw runtime_error("Can't get file size.");
+
+	return size.QuadPart;
+}
+
+// read up to limit bytes from the head of a file
+string read_sample(const string &filename, DWORD limit)
+{
+	HANDLE fp;
+	DWORD size = 0;
+
+	fp = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fp == INVALID_HANDLE_VALUE)
+		throw runtime_error("Can't open source file.");
+
+	string sample((size_t)min((ULONGLONG)limit, file_size(fp)), '\0');
+	BOOL result = sample.empty() || ReadFile(fp, &sample[0], sample.size(), &size, NULL);
+	CloseHandle(fp);
+
+	if (!result)
+		throw runtime_error("An error was occurred when reading from source file.");
+
+	sample.resize(size);
+	return sample;
+}
+
+inline DWORD gram_hash(const unsigned char *p)
+{
+	DWORD hash = 0;
+
+	for (int i = 0; i < waf_dict_gram; i++)
+		hash = hash * 131 + p[i];
+
+	return (hash * 2654435761U) >> (32 - waf_dict_hashbits);
+}
+
+// score a segment by the grams it shares with other files, zeroed grams are
+// already covered by the dictionary
+DWORD score_segment(const vector<DWORD> &freq, const unsigned char *p)
+{
+	DWORD score = 0;
+
+	for (int i = 0; i + waf_dict_gram <= waf_dict_segment; i++)
+	{
+		DWORD f = freq[gram_hash(p + i)];
+		if (f > 1)
+			score += f;
+	}
+
+	return score;
+}
+
+// pick the segments most shared between files, like a greedy set cover over
+// the sampled grams
+void waf_train_dict(void)
+{
+	vector<string> samples;
+	DWORD total = 0;
+
+	for (waf_archive::iterator it = _waf_info.begin(); it != _waf_info.end() && total < waf_dict_budget; ++it)
+	{
+		samples.push_back(read_sample(_srcdir + "/" + (*it)->filename[0], waf_dict_sample));
+		total += samples.back().size();
+	}
+
+	// count every gram once per file
+	vector<DWORD> freq(1 << waf_dict_hashbits, 0);
+	vector<DWORD> stamp(1 << waf_dict_hashbits, 0);
+
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		const unsigned char *p = (const unsigned char*)samples[i].data();
+
+		for (size_t j = 0; j + waf_dict_gram <= samples[i].size(); j++)
+		{
+			DWORD hash = gram_hash(p + j);
+			if (stamp[hash] != i + 1)
+			{
+				stamp[hash] = i + 1;
+				freq[hash]++;
+			}
+		}
+	}
+
+	typedef pair<DWORD, pair<size_t, size_t> > segment;  // score, sample, offset
+	priority_queue<segment> candidates;
+
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		const unsigned char *p = (const unsigned char*)samples[i].data();
+
+		for (size_t j = 0; j + waf_dict_segment <= samples[i].size(); j += waf_dict_segment)
+		{
+			DWORD score = score_segment(freq, p + j);
+			if (score > 0)
+				candidates.push(segment(score, make_pair(i, j)));
+		}
+	}
+
+	vector<string> chosen;
+	size_t dictsize = 0;
+
+	while (!candidates.empty() && dictsize + waf_dict_segment <= waf_dict_size)
+	{
+		segment top = candidates.top();
+		candidates.pop();
+
+		const unsigned char *p = (const unsigned char*)samples[top.second.first].data() + top.second.second;
+		DWORD score = score_segment(freq, p);
+
+		if (score == 0)
+			continue;
+
+		if (!candidates.empty() && score < candidates.top().first)
+		{
+			// score dropped since it was queued, try again later
+			candidates.push(segment(score, top.second));
+			continue;
+		}
+
+		chosen.push_back(string((const char*)p, waf_dict_segment));
+		dictsize += waf_dict_segment;
+
+		for (int i = 0; i + waf_dict_gram <= waf_dict_segment; i++)
+			freq[gram_hash(p + i)] = 0;
+	}
+
+	// deflate reaches the end of the dictionary cheapest, so the best segments go last
+	_dict.clear();
+	for (vector<string>::reverse_iterator it = chosen.rbegin(); it != chosen.rend(); ++it)
+		_dict += *it;
+}
+
+int waf_compress(unsigned char *dest, uLongf *destlen, const unsigned char *source, DWORD sourcelen)
+{
+	if (_dict.empty())
+		return compress(dest, destlen, source, sourcelen);
+
+	z_stream stream;
+	int err;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.next_in = (Bytef*)source;
+	stream.avail_in = sourcelen;
+	stream.next_out = dest;
+	stream.avail_out = *destlen;
+
+	err = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+	if (err != Z_OK)
+		return err;
+
+	err = deflateSetDictionary(&stream, (const Bytef*)_dict.data(), _dict.size());
+	if (err == Z_OK)
+		err = deflate(&stream, Z_FINISH);
+
+	*destlen = stream.total_out;
+	deflateEnd(&stream);
+
+	return err == Z_STREAM_END ? Z_OK : Z_BUF_ERROR;
+}
+
+// gear table for the rolling hash used by content-defined chunking
+static DWORD _gear[256];
+
+// a stored chunk and where its data came from
+struct chunk_ref
+{
+	ULONGLONG offset;
+	archive_info *inf;
+	ULONGLONG pos;
+};
+
+// stored chunks keyed by md5, each key may hold several chunks
+typedef map<string, vector<chunk_ref> > chunk_store;
+
+static chunk_store _chunks;
+static DWORD _shared_chunks = 0;
+static ULONGLONG _shared_bytes = 0;
+
+void init_gear(void)
+{
+	DWORD x = 0x9e3779b9;
+
+	for (int i = 0; i < 256; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		_gear[i] = x;
+	}
+}
+
+// find the end of the next chunk in data, cuts only depend on the content
+// so an edit moves at most the boundaries around it
+DWORD chunk_boundary(const unsigned char *data, DWORD size)
+{
+	DWORD limit = min(size, (DWORD)waf_chunk_max);
+	DWORD hash = 0;
+
+	for (DWORD i = waf_chunk_min; i < limit; i++)
+	{
+		hash = (hash << 1) + _gear[data[i]];
+		if (!(hash & waf_chunk_mask))
+			return i + 1;
+	}
+
+	return limit;
+}
+
+// a block of one repeated byte is stored as that byte only
+bool fill_block(const unsigned char *data, DWORD size)
+{
+	for (DWORD i = 1; i < size; i++)
+	{
+		if (data[i] != data[0])
+			return false;
+	}
+
+	return size > 0;
+}
+
+// compare a chunk with the source data of one already stored, since md5
+// is not 100% accurate
+bool compare_chunk(const chunk_ref &ref, const unsigned char *data, DWORD size)
+{
+	unsigned char stored[waf_chunk_max];
+	HANDLE fp;
+	LARGE_INTEGER pos;
+	DWORD read;
+	bool same;
+
+	string fullpath = _srcdir + "/" + ref.inf->filename[0];
+
+	fp = CreateFile(fullpath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fp == INVALID_HANDLE_VALUE)
+		return false;
+
+	pos.QuadPart = ref.pos;
+	same = SetFilePointerEx(fp, pos, NULL, FILE_BEGIN) &&
+		ReadFile(fp, stored, size, &read, NULL) && read == size &&
+		memcmp(stored, data, size) == 0;
+
+	CloseHandle(fp);
+
+	return same;
+}
+
+// write to the archive and keep track of the output position
+BOOL waf_write(HANDLE hFile, const void *data, DWORD size)
 {
 	DWORD written;
-	BOOL result = true;
+
+	if (size > 0 && (!WriteFile(hFile, data, size, &written, NULL) || written != size))
+		return FALSE;
+
+	md5_update(&_outmd5, (unsigned char*)data, size);
+	_outpos += size;
+	return TRUE;
+}
+
+// store a chunk unless an identical one exists, returns the chunk offset
+ULONGLONG waf_store_chunk(HANDLE hFile, unsigned char *data, DWORD size, archive_info *inf, ULONGLONG pos)
+{
+	unsigned char outbuff[waf_raw_size];
+	uLongf outsize = waf_raw_size;
+	DWORD word;
+
+	if (fill_block(data, size))
+	{
+		outsize = 0;
+		word = waf_block_fill | data[0];
+	}
+	else
+	{
+		if (waf_compress(outbuff, &outsize, data, size) != Z_OK)
+			throw runtime_error("An error was occurred when compressing data.");
+
+		word = outsize;
+	}
+
+	md5_context md5;
+
+	md5_init(&md5);
+	md5_update(&md5, data, size);
+	md5_final(&md5);
+
+	vector<chunk_ref> &same_md5 = _chunks[string((const char*)md5.digest, 16)];
+
+	for (vector<chunk_ref>::iterator it = same_md5.begin(); it != same_md5.end(); ++it)
+	{
+		if (compare_chunk(*it, data, size))
+		{
+			_shared_chunks++;
+			_shared_bytes += size;
+			return it->offset;
+		}
+	}
+
+	chunk_ref ref;
+	ref.offset = _outpos;
+	ref.inf = inf;
+	ref.pos = pos;
+
+	BOOL result = TRUE;
+	result = result && waf_write(hFile, &word, sizeof(DWORD));
+	result = result && waf_write(hFile, outbuff, outsize);
+
+	if (!result)
+		throw runtime_error("An error was occurred when storing data block.");
+
+	same_md5.push_back(ref);
+
+	return ref.offset;
+}
+
+// bottom-k sketch over content-defined sample points, files sharing most
+// of their sketch share most of their content
+vector<DWORD> file_sketch(const string &filename, ULONGLONG *size)
+{
+	HANDLE fp;
+	unsigned char buff[waf_src_size];
+	DWORD datasize;
+	DWORD hash = 0;
+	set<DWORD> sketch;
+
+	fp = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fp == INVALID_HANDLE_VALUE)
+		throw runtime_error("Can't open source file.");
+
+	*size = file_size(fp);
+
+	while (ReadFile(fp, buff, waf_src_size, &datasize, NULL) && datasize > 0)
+	{
+		for (DWORD i = 0; i < datasize; i++)
+		{
+			hash = (hash << 1) + _gear[buff[i]];
+
+			// sample about one position in 64
+			if (!(hash & 0xfc000000))
+			{
+				sketch.insert(hash * 2654435761U);
+				if (sketch.size() > waf_sketch_size)
+					sketch.erase(--sketch.end());
+			}
+		}
+	}
+
+	CloseHandle(fp);
+
+	return vector<DWORD>(sketch.begin(), sketch.end());
+}
+
+// pick a base for every file that is mostly the same as an earlier one,
+// variants name their base by its data record in the index
+void waf_find_variants(void)
+{
+	map<DWORD, vector<archive_info*> > owners;  // sketch value to base candidates
+	DWORD variants = 0;
+
+	for (waf_archive::iterator it = _waf_info.begin(); it != _waf_info.end(); ++it)
+	{
+		archive_info *inf = *it;
+		vector<DWORD> sketch = file_sketch(_srcdir + "/" + inf->filename[0], &inf->size);
+
+		if (inf->size == 0 || inf->size > waf_delta_max_file || sketch.size() < waf_sketch_size / 8)
+			continue;
+
+		map<archive_info*, DWORD> shared;
+		archive_info *best = NULL;
+
+		for (vector<DWORD>::iterator h = sketch.begin(); h != sketch.end(); ++h)
+		{
+			map<DWORD, vector<archive_info*> >::iterator found = owners.find(*h);
+			if (found == owners.end())
+				continue;
+
+			for (vector<archive_info*>::iterator o = found->second.begin(); o != found->second.end(); ++o)
+			{
+				// sizes too far apart make a poor delta
+				if ((*o)->size / 2 > inf->size || inf->size / 2 > (*o)->size)
+					continue;
+
+				if (++shared[*o] > (best ? shared[best] : 0))
+					best = *o;
+			}
+		}
+
+		if (best && shared[best] * 2 >= sketch.size())
+		{
+			inf->base = best;
+			variants++;
+		}
+		else
+		{
+			for (vector<DWORD>::iterator h = sketch.begin(); h != sketch.end(); ++h)
+				owners[*h].push_back(inf);
+		}
+	}
+
+	fprintf(_msg, "%u similar files will be stored as deltas.\n", variants);
+}
+
+inline DWORD delta_hash(const unsigned char *p)
+{
+	DWORD hash = 0;
+
+	for (int i = 0; i < waf_delta_window; i++)
+		hash = hash * 131 + p[i];
+
+	return (hash * 2654435761U) >> (32 - waf_delta_hashbits);
+}
+
+// base file data with a hash table of window positions
+struct delta_base
+{
+	string data;
+	vector<DWORD> table;  // position + 1, 0 for empty
+
+	void index(void)
+	{
+		const unsigned char *p = (const unsigned char*)data.data();
+
+		table.assign(1 << waf_delta_hashbits, 0);
+		for (DWORD i = 0; i + waf_delta_window <= data.size(); i++)
+			table[delta_hash(p + i)] = i + 1;
+	}
+};
+
+void put_u32(string &str, DWORD value)
+{
+	str += (char)(value & 0xff);
+	str += (char)((value >> 8) & 0xff);
+	str += (char)((value >> 16) & 0xff);
+	str += (char)((value >> 24) & 0xff);
+}
+
+void put_u64(string &str, ULONGLONG value)
+{
+	put_u32(str, (DWORD)value);
+	put_u32(str, (DWORD)(value >> 32));
+}
+
+void delta_add(string &ops, const unsigned char *data, DWORD size)
+{
+	if (size == 0)
+		return;
+
+	ops += (char)waf_delta_add;
+	put_u32(ops, size);
+	ops.append((const char*)data, size);
+}
+
+// encode data as copies from the base plus literal runs
+void delta_encode(const delta_base &base, const unsigned char *data, DWORD size, string &ops)
+{
+	const unsigned char *bp = (const unsigned char*)base.data.data();
+	DWORD bsize = base.data.size();
+	DWORD lit = 0;  // start of the pending literal run
+	DWORD i = 0;
+
+	ops.clear();
+
+	while (i + waf_delta_window <= size)
+	{
+		DWORD cand = base.table[delta_hash(data + i)];
+
+		if (cand > 0)
+		{
+			DWORD pos = cand - 1;
+			DWORD len = 0;
+			DWORD back = 0;
+
+			while (i + len < size && pos + len < bsize && data[i + len] == bp[pos + len])
+				len++;
+
+			// take back what the literal run shares with the base too
+			while (back < i - lit && back < pos && data[i - back - 1] == bp[pos - back - 1])
+				back++;
+
+			if (len + back >= waf_delta_minmatch)
+			{
+				delta_add(ops, data + lit, i - back - lit);
+
+				ops += (char)waf_delta_copy;
+				put_u32(ops, pos - back);
+				put_u32(ops, len + back);
+
+				i += len;
+				lit = i;
+				continue;
+			}
+		}
+
+		i++;
+	}
+
+	delta_add(ops, data + lit, size - lit);
+}
+
+#define CONST64(hi, lo) (((ULONGLONG)(hi) << 32) | (ULONGLONG)(lo))
+
+// name hash of the packed index (64-bit fnv-1a), must match the reader
+ULONGLONG name_hash(const string &name)
+{
+	ULONGLONG hash = CONST64(0xcbf29ce4, 0x84222325);
+
+	for (string::size_type i = 0; i < name.size(); i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= CONST64(0x100, 0x000001b3);
+	}
+
+	return hash;
+}
+
+ULONGLONG hash_mix(ULONGLONG h)
+{
+	h ^= h >> 33;
+	h *= CONST64(0xff51afd7, 0xed558ccd);
+	h ^= h >> 33;
+	h *= CONST64(0xc4ceb9fe, 0x1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+// slot of a name in a bucket with displacement d
+DWORD hash_slot(ULONGLONG hash, DWORD d, DWORD count)
+{
+	return (DWORD)(hash_mix(hash + d * CONST64(0x9e3779b9, 0x7f4a7c15)) % count);
+}
+
+// a name in the index and the data record it refers to
+struct index_entry
+{
+	string name;
+	DWORD ref;
+
+	bool operator<(const index_entry &other) const
+	{
+		return name < other.name;
+	}
+};
+
+// collect the entries of a file for the index, aliases share one data record
+void waf_saveinfo(vector<index_entry> &entries, string &data, archive_info *inf)
+{
+	DWORD ref = data.size() / (sizeof(ULONGLONG) * 3);
+
+	put_u64(data, inf->size);
+	put_u64(data, inf->offset);
+	put_u64(data, inf->extent);
 
 	for (vector<string>::iterator it = inf->filename.begin(); it != inf->filename.end(); ++it)
 	{
-		string name = _pathadd + *it;
-		int len = name.length();
+		index_entry e;
 
-		// write archive info
-		result = result && WriteFile(hFile, &len, sizeof(int), &written, NULL);
-		result = result && WriteFile(hFile, name.c_str(), len, &written, NULL);
-		result = result && WriteFile(hFile, &inf->size, sizeof(DWORD), &written, NULL);
-		result = result && WriteFile(hFile, &inf->offset, sizeof(DWORD), &written, NULL);
+		e.name = _pathadd + *it;
+		e.ref = ref;
+		if (e.name.length() > waf_max_name)
+			throw runtime_error("File name too long: " + e.name);
+		entries.push_back(e);
+	}
+}
 
-		if (!result)
-			throw runtime_error("An error was occurred when storing archive info.");
+void put_varint(string &str, DWORD value)
+{
+	while (value >= 0x80)
+	{
+		str += (char)(value | 0x80);
+		value >>= 7;
+	}
+	str += (char)value;
+}
+
+// orders bucket numbers by their name count, most first
+struct bucket_larger
+{
+	const vector<vector<DWORD> > &buckets;
+
+	bucket_larger(const vector<vector<DWORD> > &b) : buckets(b) {}
+
+	bool operator()(DWORD a, DWORD b) const
+	{
+		return buckets[a].size() > buckets[b].size();
+	}
+};
+
+// build the packed index: names sorted and front-coded with restart points,
+// plus a minimal perfect hash (hash and displace) that gives each name its own slot
+void waf_build_index(vector<index_entry> &entries, const string &data, string &index)
+{
+	sort(entries.begin(), entries.end());
+	for (DWORD i = 1; i < entries.size(); i++)
+	{
+		if (entries[i].name == entries[i - 1].name)
+			throw runtime_error("Duplicate file name: " + entries[i].name);
+	}
+
+	DWORD count = entries.size();
+	DWORD nbuckets = count / waf_index_bucket + 1;
+	vector<ULONGLONG> hashes(count);
+	vector<vector<DWORD> > buckets(nbuckets);
+	vector<DWORD> disp(nbuckets, 0);
+	vector<DWORD> slots(count, 0);
+	vector<bool> taken(count, false);
+
+	for (DWORD i = 0; i < count; i++)
+	{
+		hashes[i] = name_hash(entries[i].name);
+		buckets[hashes[i] % nbuckets].push_back(i);
+	}
+
+	// fill the crowded buckets first while most slots are still free
+	vector<DWORD> order;
+	for (DWORD b = 0; b < nbuckets; b++)
+		order.push_back(b);
+	stable_sort(order.begin(), order.end(), bucket_larger(buckets));
+
+	vector<DWORD> placed;
+	for (vector<DWORD>::iterator it = order.begin(); it != order.end() && !buckets[*it].empty(); ++it)
+	{
+		const vector<DWORD> &bucket = buckets[*it];
+		DWORD d;
+
+		for (d = 0; d < waf_index_tries; d++)
+		{
+			placed.clear();
+			for (DWORD k = 0; k < bucket.size(); k++)
+			{
+				DWORD slot = hash_slot(hashes[bucket[k]], d, count);
+
+				if (taken[slot] || find(placed.begin(), placed.end(), slot) != placed.end())
+					break;
+				placed.push_back(slot);
+			}
+
+			if (placed.size() == bucket.size())
+				break;
+		}
+
+		if (d == waf_index_tries)
+			throw runtime_error("Can't build archive index.");
+
+		disp[*it] = d;
+		for (DWORD k = 0; k < bucket.size(); k++)
+		{
+			taken[placed[k]] = true;
+			slots[placed[k]] = bucket[k];
+		}
+	}
+
+	// each name stores the length it shares with the one before and the rest
+	string names;
+	string restarts;
+	for (DWORD i = 0; i < count; i++)
+	{
+		const string &name = entries[i].name;
+		DWORD shared = 0;
+
+		if (i % waf_restart_interval == 0)
+		{
+			put_u32(restarts, names.size());
+		}
+		else
+		{
+			const string &prev = entries[i - 1].name;
+
+			while (shared < name.size() && shared < prev.size() && name[shared] == prev[shared])
+				shared++;
+		}
+
+		put_varint(names, shared);
+		put_varint(names, name.size() - shared);
+		names.append(name, shared, string::npos);
+	}
+
+	// [name count][bucket count][data count][names size][displacements][slots][refs][data][restarts][names]
+	index.clear();
+	put_u32(index, count);
+	put_u32(index, nbuckets);
+	put_u32(index, data.size() / (sizeof(ULONGLONG) * 3));
+	put_u32(index, names.size());
+	for (DWORD b = 0; b < nbuckets; b++)
+		put_u32(index, disp[b]);
+	for (DWORD i = 0; i < count; i++)
+		put_u32(index, slots[i]);
+	for (DWORD i = 0; i < count; i++)
+		put_u32(index, entries[i].ref);
+	index += data;
+	index += restarts;
+	index += names;
+}
+
+// C identifier for an entry name, other characters become '_'
+string id_name(const string &name)
+{
+	string id;
+
+	if (name.empty() || (name[0] >= '0' && name[0] <= '9'))
+		id += '_';
+
+	for (string::size_type i = 0; i < name.size(); i++)
+	{
+		char c = name[i];
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+			id += c;
+		else
+			id += '_';
+	}
+
+	return id;
+}
+
+string upper_str(string str)
+{
+	for (string::size_type i = 0; i < str.size(); i++)
+	{
+		if (str[i] >= 'a' && str[i] <= 'z')
+			str[i] = str[i] - 'a' + 'A';
+	}
+
+	return str;
+}
+
+// write a header with the id and name hash of every entry, entries must be in index order
+void waf_write_ids(const vector<index_entry> &entries)
+{
+	FILE *fp = fopen(_idheader.c_str(), "w");
+	if (!fp)
+		throw runtime_error("Can't create id header '" + _idheader + "'.");
+
+	string::size_type slash = _idheader.find_last_of("/\\");
+	string guard = upper_str(id_name(slash == string::npos ? _idheader : _idheader.substr(slash + 1)));
+
+	// names that map to the same identifier get their id appended
+	vector<string> ids;
+	set<string> used;
+	for (DWORD i = 0; i < entries.size(); i++)
+	{
+		string id = id_name(entries[i].name);
+		char num[16];
+
+		sprintf(num, "_%u", (unsigned)i);
+		while (!used.insert(id).second)
+			id += num;
+		ids.push_back(id);
+	}
+
+	fprintf(fp, "/* generated by waf, do not edit */\n");
+	fprintf(fp, "/* entry ids for waf_open_id(), valid for archives built from the same names */\n");
+	fprintf(fp, "/* hashes are 64-bit fnv-1a of the entry names */\n\n");
+	fprintf(fp, "#ifndef __%s__\n", guard.c_str());
+	fprintf(fp, "#define __%s__\n\n", guard.c_str());
+	fprintf(fp, "#define WAF_ENTRY_COUNT %u\n\n", (unsigned)entries.size());
+
+	fprintf(fp, "#if defined(__cplusplus) && __cplusplus >= 201103L\n\n");
+	fprintf(fp, "namespace waf_entry\n{\n");
+	fprintf(fp, "\tstruct info\n\t{\n\t\tunsigned long long id;\n\t\tunsigned long long hash;\n\t};\n\n");
+	for (DWORD i = 0; i < entries.size(); i++)
+	{
+		ULONGLONG hash = name_hash(entries[i].name);
+
+		fprintf(fp, "\tconstexpr info %s = { %u, 0x%08x%08xULL };\n", ids[i].c_str(), (unsigned)i,
+			(unsigned)(hash >> 32), (unsigned)hash);
+	}
+	fprintf(fp, "}\n\n");
+
+	fprintf(fp, "#else\n\n");
+	for (DWORD i = 0; i < entries.size(); i++)
+	{
+		ULONGLONG hash = name_hash(entries[i].name);
+		string id = upper_str(ids[i]);
+
+		fprintf(fp, "#define WAF_ID_%s %u\n", id.c_str(), (unsigned)i);
+		fprintf(fp, "#define WAF_HASH_%s 0x%08x%08xULL\n", id.c_str(), (unsigned)(hash >> 32), (unsigned)hash);
 	}
+	fprintf(fp, "\n#endif\n\n");
+
+	fprintf(fp, "#endif  /* __%s__ */\n", guard.c_str());
+
+	bool failed = ferror(fp) != 0;
+	if (fclose(fp) != 0 || failed)
+		throw runtime_error("An error was occurred when writing id header.");
 }
 
 void waf_append(HANDLE hFile, archive_info *inf)
 {
 	for (vector<string>::iterator it = inf->filename.begin(); it != inf->filename.end(); ++it)
 	{
-		printf("Compressing %s...\n", it->c_str());
+		fprintf(_msg, "Compressing %s...\n", it->c_str());
 	}
 
 	HANDLE src = INVALID_HANDLE_VALUE;
 	unsigned char srcbuff[waf_src_size];
 	unsigned char outbuff[waf_raw_size];
+	unsigned char deltabuff[waf_raw_size];
 	DWORD datasize;
+	DWORD word;
 	uLongf outsize;
+	uLongf deltasize;
+	delta_base base;
+	string ops;
 
 	try
 	{
@@ -321,8 +1248,23 @@ void waf_append(HANDLE hFile, archive_info *inf)
 		if (src == INVALID_HANDLE_VALUE)
 			throw runtime_error("Can't open source file.");
 
-		inf->offset = GetFileSize(hFile, NULL);
-		inf->size = GetFileSize(src, NULL);
+		inf->offset = _outpos;
+		inf->size = file_size(src);
+
+		if (_use_delta)
+		{
+			// data record of the base file + 1, 0 if none
+			string baseref;
+			put_u64(baseref, inf->base ? inf->base->ref + 1 : 0);
+			if (!waf_write(hFile, baseref.data(), baseref.size()))
+				throw runtime_error("An error was occurred when storing data block.");
+
+			if (inf->base)
+			{
+				base.data = read_sample(_srcdir + "/" + inf->base->filename[0], waf_delta_max_file);
+				base.index();
+			}
+		}
 		
 		while (1)
 		{
@@ -332,15 +1274,42 @@ void waf_append(HANDLE hFile, archive_info *inf)
 			if (datasize == 0)
 				break;
 
-			// compress
-			outsize = waf_raw_size;
-			if (compress(outbuff, &outsize, srcbuff, datasize) != Z_OK)
-				throw runtime_error("An error was occurred when compressing data.");
+			if (fill_block(srcbuff, datasize))
+			{
+				// the reader rebuilds it with memset
+				outsize = 0;
+				word = waf_block_fill | srcbuff[0];
+			}
+			else
+			{
+				// compress
+				outsize = waf_raw_size;
+				if (waf_compress(outbuff, &outsize, srcbuff, datasize) != Z_OK)
+					throw runtime_error("An error was occurred when compressing data.");
+
+				word = outsize;
+			}
+
+			if (inf->base && outsize > 0)
+			{
+				// keep the delta if it beats the plain block
+				delta_encode(base, srcbuff, datasize, ops);
+
+				deltasize = waf_raw_size;
+				if (ops.size() <= waf_raw_size &&
+					waf_compress(deltabuff, &deltasize, (const unsigned char*)ops.data(), ops.size()) == Z_OK &&
+					deltasize < outsize)
+				{
+					memcpy(outbuff, deltabuff, deltasize);
+					outsize = deltasize;
+					word = deltasize | waf_block_delta;
+				}
+			}
 
 			// save block size and block data
 			BOOL result = TRUE;
-			result = result && WriteFile(hFile, &outsize, sizeof(DWORD), &datasize, NULL);
-			result = result && WriteFile(hFile, outbuff, outsize, &datasize, NULL);
+			result = result && waf_write(hFile, &word, sizeof(DWORD));
+			result = result && waf_write(hFile, outbuff, outsize);
 
 			if (!result)
 				throw runtime_error("An error was occurred when storing data block.");
@@ -348,9 +1317,11 @@ void waf_append(HANDLE hFile, archive_info *inf)
 
 		// a zero size block to indicate end of a file
 		outsize = 0;
-		if (!WriteFile(hFile, &outsize, sizeof(DWORD), &datasize, NULL))
+		if (!waf_write(hFile, &outsize, sizeof(DWORD)))
 			throw runtime_error("An error was occurred when storing data block.");
 
+		inf->extent = _outpos - inf->offset;
+
 		CloseHandle(src);
 	}
 	catch (runtime_error &e)
@@ -362,19 +1333,151 @@ void waf_append(HANDLE hFile, archive_info *inf)
 	}
 }
 
+void waf_append_chunks(HANDLE hFile, archive_info *inf)
+{
+	for (vector<string>::iterator it = inf->filename.begin(); it != inf->filename.end(); ++it)
+	{
+		fprintf(_msg, "Compressing %s...\n", it->c_str());
+	}
+
+	HANDLE src = INVALID_HANDLE_VALUE;
+	vector<unsigned char> buff(waf_chunk_max * 2);
+	DWORD fill = 0;
+	DWORD datasize;
+	ULONGLONG srcpos = 0;  // source position of buff[0]
+	bool eof = false;
+
+	// offset and uncompressed size of every chunk
+	string chunks;
+	DWORD count = 0;
+
+	try
+	{
+		string fullpath = _srcdir + "/" + inf->filename[0];
+
+		src = CreateFile(fullpath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (src == INVALID_HANDLE_VALUE)
+			throw runtime_error("Can't open source file.");
+
+		inf->size = file_size(src);
+
+		while (1)
+		{
+			// keep at least one max chunk buffered so the boundary search is not cut short
+			while (!eof && fill < buff.size())
+			{
+				if (!ReadFile(src, &buff[fill], buff.size() - fill, &datasize, NULL))
+					throw runtime_error("An error was occurred when reading from source file.");
+
+				if (datasize == 0)
+					eof = true;
+
+				fill += datasize;
+			}
+
+			if (fill == 0)
+				break;
+
+			DWORD cut = chunk_boundary(&buff[0], fill);
+
+			put_u64(chunks, waf_store_chunk(hFile, &buff[0], cut, inf, srcpos));
+			put_u32(chunks, cut);
+			count++;
+
+			memmove(&buff[0], &buff[cut], fill - cut);
+			fill -= cut;
+			srcpos += cut;
+		}
+
+		// the chunk list is what the file entry points to
+		inf->offset = _outpos;
+
+		BOOL result = TRUE;
+
+		result = result && waf_write(hFile, &count, sizeof(DWORD));
+		result = result && waf_write(hFile, chunks.data(), chunks.size());
+
+		if (!result)
+			throw runtime_error("An error was occurred when storing chunk list.");
+
+		inf->extent = _outpos - inf->offset;
+
+		CloseHandle(src);
+	}
+	catch (runtime_error &e)
+	{
+		if (src != INVALID_HANDLE_VALUE)
+			CloseHandle(src);
+
+		throw e;
+	}
+}
+
 bool waf_build(void)
 {
 	HANDLE hFile;
-	DWORD written;
+	bool streaming = _outname == "-";
 
-	printf("Scanning for files...\n");
+	fprintf(_msg, "Scanning for files...\n");
 	scandir(_srcdir, "");
 
-	printf("\n");
-	hFile = CreateFile(_outname.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	// before delta bases are picked, since a base must come before its variants
+	if (!_tracefile.empty())
+	{
+		try
+		{
+			waf_apply_trace();
+		}
+		catch (runtime_error &e)
+		{
+			fprintf(_msg, "%s\n", e.what());
+			return false;
+		}
+	}
+
+	if (_use_delta)
+	{
+		fprintf(_msg, "Looking for similar files...\n");
+
+		try
+		{
+			waf_find_variants();
+		}
+		catch (runtime_error &e)
+		{
+			fprintf(_msg, "%s\n", e.what());
+			return false;
+		}
+	}
+
+	if (_use_dict)
+	{
+		fprintf(_msg, "Training dictionary...\n");
+
+		try
+		{
+			waf_train_dict();
+		}
+		catch (runtime_error &e)
+		{
+			fprintf(_msg, "%s\n", e.what());
+			return false;
+		}
+
+		if (_dict.empty())
+			fprintf(_msg, "No common data found, dictionary disabled.\n");
+		else
+			fprintf(_msg, "Dictionary size %u bytes.\n", (unsigned)_dict.size());
+	}
+
+	fprintf(_msg, "\n");
+	if (streaming)
+		hFile = GetStdHandle(STD_OUTPUT_HANDLE);
+	else
+		hFile = CreateFile(_outname.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hFile == INVALID_HANDLE_VALUE)
 	{
-		printf("Can't create output file.\n");
+		fprintf(_msg, "Can't create output file.\n");
 		return false;
 	}
 
@@ -386,10 +1489,18 @@ bool waf_build(void)
 		buff[0] = 'w';
 		buff[1] = 'a';
 		buff[2] = 'f';
-		buff[3] = 0;
+		buff[3] = waf_flag_extent | waf_flag_trailer | waf_flag_large | waf_flag_index | waf_flag_digest;
+		if (!_dict.empty())
+			buff[3] |= waf_flag_dict;
+		if (_use_chunks)
+			buff[3] |= waf_flag_chunks;
+		if (_use_delta)
+			buff[3] |= waf_flag_delta;
 
 		DWORD *p = (DWORD*)&buff[4];
 
+		md5_init(&_outmd5);
+
 		*p++ = waf_src_size;
 		
 		*p = 0;
@@ -398,32 +1509,78 @@ bool waf_build(void)
 			*p += (*it)->filename.size();
 		}
 
-		if (!WriteFile(hFile, buff, sizeof(buff), &written, NULL))
+		if (!waf_write(hFile, buff, sizeof(buff)))
 			throw runtime_error("An error was occurred when storing archive signature.");
 
-		// archive info
-		for_each(_waf_info.begin(), _waf_info.end(), bind1st(ptr_fun(waf_saveinfo), hFile));
-		
+		// preset dictionary
+		if (!_dict.empty())
+		{
+			DWORD dictsize = _dict.size();
+			BOOL result = TRUE;
+
+			result = result && waf_write(hFile, &dictsize, sizeof(DWORD));
+			result = result && waf_write(hFile, _dict.data(), dictsize);
+
+			if (!result)
+				throw runtime_error("An error was occurred when storing dictionary.");
+		}
+
+		// deltas refer to their base by its data record
+		DWORD ref = 0;
+		for (waf_archive::iterator it = _waf_info.begin(); it != _waf_info.end(); ++it)
+			(*it)->ref = ref++;
+
 		// archive file data
-		for_each(_waf_info.begin(), _waf_info.end(), bind1st(ptr_fun(waf_append), hFile));
+		void (*append)(HANDLE, archive_info*) = _use_chunks ? waf_append_chunks : waf_append;
+		for_each(_waf_info.begin(), _waf_info.end(), bind1st(ptr_fun(append), hFile));
+
+		// archive info follows the data, so the archive is written in one pass
+		vector<index_entry> entries;
+		string data;
+		for (waf_archive::iterator it = _waf_info.begin(); it != _waf_info.end(); ++it)
+			waf_saveinfo(entries, data, *it);
 
-		// update archive info
-		SetFilePointer(hFile, sizeof(buff), NULL, FILE_BEGIN);
-		for_each(_waf_info.begin(), _waf_info.end(), bind1st(ptr_fun(waf_saveinfo), hFile));
+		string index;
+		waf_build_index(entries, data, index);
 
-		SetFilePointer(hFile, 0, NULL, FILE_END);
+		if (!_idheader.empty())
+			waf_write_ids(entries);
 
-		CloseHandle(hFile);
+		ULONGLONG indexpos = _outpos;
+		if (!waf_write(hFile, index.data(), index.size()))
+			throw runtime_error("An error was occurred when storing archive info.");
+
+		// content digest, caches shared between processes key blocks by it
+		md5_final(&_outmd5);
+		if (!waf_write(hFile, _outmd5.digest, sizeof(_outmd5.digest)))
+			throw runtime_error("An error was occurred when storing archive digest.");
+
+		// trailer tells the reader where the index is
+		string trailer;
+		put_u64(trailer, indexpos);
+		put_u64(trailer, index.size());
+		put_u32(trailer, waf_trailer_signature);
+
+		if (!waf_write(hFile, trailer.data(), trailer.size()))
+			throw runtime_error("An error was occurred when storing archive trailer.");
 
-		printf("\n");
-		printf("Build archive '%s' success.\n", _outname.c_str());
+		if (!streaming)
+			CloseHandle(hFile);
+
+		fprintf(_msg, "\n");
+		if (_use_chunks)
+			fprintf(_msg, "%u chunks (%u KB) shared between files.\n", _shared_chunks, (unsigned)(_shared_bytes >> 10));
+		fprintf(_msg, "Build archive '%s' success.\n", _outname.c_str());
 	}
 	catch (runtime_error &e)
 	{
-		CloseHandle(hFile);
-		DeleteFile(_outname.c_str());
+		if (!streaming)
+		{
+			CloseHandle(hFile);
+			DeleteFile(_outname.c_str());
+		}
 
-		printf("%s\n", e.what());
+		fprintf(_msg, "%s\n", e.what());
 
 		return false;
 	}
@@ -450,6 +1607,8 @@ bool parse_args(int argc, char *argv[])
 	{
 		ps_normal,
 		ps_path,
+		ps_header,
+		ps_trace,
 	};
 
 	if (argc < 3)
@@ -458,6 +1617,9 @@ bool parse_args(int argc, char *argv[])
 	_srcdir = argv[1];
 	_outname = argv[2];
 
+	if (_outname == "-")
+		_msg = stderr;
+
 	parse_status status = ps_normal;
 
 	for (int i = 3; i < argc; i++)
@@ -470,10 +1632,30 @@ bool parse_args(int argc, char *argv[])
 			{
 				_include_hidden = true;
 			}
+			else if (arg == "-d")
+			{
+				_use_dict = true;
+			}
+			else if (arg == "-c")
+			{
+				_use_chunks = true;
+			}
+			else if (arg == "-v")
+			{
+				_use_delta = true;
+			}
 			else if (arg == "-p")
 			{
 				status = ps_path;
 			}
+			else if (arg == "-g")
+			{
+				status = ps_header;
+			}
+			else if (arg == "-t")
+			{
+				status = ps_trace;
+			}
 		}
 		else if (status == ps_path)
 		{
@@ -483,6 +1665,18 @@ bool parse_args(int argc, char *argv[])
 
 			_pathadd = arg;
 
+			status = ps_normal;
+		}
+		else if (status == ps_header)
+		{
+			_idheader = arg;
+
+			status = ps_normal;
+		}
+		else if (status == ps_trace)
+		{
+			_tracefile = arg;
+
 			status = ps_normal;
 		}
 	}
@@ -490,6 +1684,10 @@ bool parse_args(int argc, char *argv[])
 	if (status != ps_normal)
 		return false;
 
+	// a chunk list has no room for a base file
+	if (_use_chunks && _use_delta)
+		return false;
+
 	return true;
 }
 
@@ -497,18 +1695,29 @@ void show_usage(void)
 {
 	printf("Usage: waf <src path> <outfile> [options]\n");
 	printf("\n");
+	printf("Use - as outfile to write the archive to stdout.\n");
+	printf("\n");
 	printf("Options:\n");
 	printf("\n");
 	printf("  -h           Include hidden files.\n");
 	printf("  -p <path>    Add a relative path before filename.\n");
+	printf("  -d           Train a preset dictionary shared by all blocks.\n");
+	printf("  -c           Split files into content-defined chunks, store shared chunks once.\n");
+	printf("  -v           Store files similar to an earlier one as deltas against it.\n");
+	printf("               Can't be used with -c.\n");
+	printf("  -g <header>  Write a C/C++ header with the id and name hash of every entry.\n");
+	printf("  -t <trace>   Lay files out in the order they were first read in an access trace\n");
+	printf("               recorded with waf_archive_record.\n");
 }
 
 int main(int argc, char *argv[])
 {
-	printf("WANE's Archive File Maker\n");
-	printf("Copyright (c) 2010-2011 wane. All rights reserved.\n\n");
+	bool parsed = parse_args(argc, argv);
+
+	fprintf(_msg, "WANE's Archive File Maker\n");
+	fprintf(_msg, "Copyright (c) 2010-2011 wane. All rights reserved.\n\n");
 
-	if (!parse_args(argc, argv))
+	if (!parsed)
 	{
 		show_usage();
 		return 1;
@@ -516,11 +1725,13 @@ int main(int argc, char *argv[])
 
 	if (!md5_initsys())
 	{
-		printf("Can't initialize MD5 function.\n"
+		fprintf(_msg, "Can't initialize MD5 function.\n"
 			"Microsoft Windows 2000 or later Windows system is required.\n");
 		return 2;
 	}
 
+	init_gear();
+
 	bool result = waf_build();
 
 	md5_freesys();
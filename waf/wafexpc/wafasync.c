@@ -0,0 +1,436 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+/* asynchronous reads: a priority scheduler running on the job pool */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "wafexp.h"
+#include "wafconf.h"
+#include "wafthread.h"
+
+/* request states */
+#define WAF_REQUEST_QUEUED 0
+#define WAF_REQUEST_RUNNING 1
+#define WAF_REQUEST_DONE 2
+
+struct waf_request
+{
+	struct waf_request *next;  /* queue link */
+	struct waf_request *prev;
+
+	waf_archive *arc;
+	waf_size_t id;
+	waf_size_t offset;
+	unsigned char *buff;
+	waf_size_t size;
+	int priority;
+	waf_read_callback callback;
+	void *user;
+
+	waf_file *file;  /* open while the request is in progress */
+	waf_size_t done;  /* bytes read so far */
+	int state;
+	int cancelled;
+	int result;
+	int refs;  /* the caller's handle and the scheduler */
+};
+
+/* requests of one priority, oldest first */
+struct waf_queue
+{
+	struct waf_request *head;
+	struct waf_request *tail;
+};
+
+static struct
+{
+	waf_mutex_t lock;
+	waf_cond_t done;  /* a request or a job finished */
+	struct waf_queue queues[WAF_PRIORITY_COUNT];
+	unsigned long jobs;  /* pool jobs submitted and not finished */
+	int ownpool;  /* the pool was started for the scheduler */
+	int stopping;
+} waf_sched;
+
+static int waf_sched_started = 0;
+
+static void waf_queue_push(struct waf_request *req, int front)
+{
+	struct waf_queue *q = &waf_sched.queues[req->priority];
+
+	req->state = WAF_REQUEST_QUEUED;
+
+	if (front)
+	{
+		req->prev = NULL;
+		req->next = q->head;
+		if (q->head)
+			q->head->prev = req;
+		else
+			q->tail = req;
+		q->head = req;
+	}
+	else
+	{
+		req->next = NULL;
+		req->prev = q->tail;
+		if (q->tail)
+			q->tail->next = req;
+		else
+			q->head = req;
+		q->tail = req;
+	}
+}
+
+static void waf_queue_remove(struct waf_request *req)
+{
+	struct waf_queue *q = &waf_sched.queues[req->priority];
+
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		q->head = req->next;
+
+	if (req->next)
+		req->next->prev = req->prev;
+	else
+		q->tail = req->prev;
+
+	req->next = NULL;
+	req->prev = NULL;
+}
+
+/* the most urgent queued request */
+static struct waf_request* waf_queue_first(int below)
+{
+	int i;
+
+	for (i = 0; i < below; i++)
+	{
+		if (waf_sched.queues[i].head)
+			return waf_sched.queues[i].head;
+	}
+
+	return NULL;
+}
+
+static void waf_request_unref(struct waf_request *req)
+{
+	if (--req->refs == 0)
+		free(req);
+}
+
+/* called with the lock held, returns with it held */
+static void waf_request_finish(struct waf_request *req, int result)
+{
+	if (req->file)
+	{
+		waf_close(req->file);
+		req->file = NULL;
+	}
+
+	req->result = req->cancelled ? WAF_CANCELLED : result;
+	req->state = WAF_REQUEST_DONE;
+
+	waf_mutex_unlock(&waf_sched.lock);
+	if (req->callback)
+		req->callback(req, req->result, req->done, req->user);
+	waf_mutex_lock(&waf_sched.lock);
+
+	waf_cond_broadcast(&waf_sched.done);
+	waf_request_unref(req);
+}
+
+/* read the next slice of a request, returns 1 when the request is complete */
+static int waf_request_step(struct waf_request *req, int *result)
+{
+	waf_size_t size;
+	int status;
+
+	if (!req->file)
+	{
+		req->file = waf_open_id(req->arc, req->id);
+		if (!req->file || waf_seek(req->file, (waf_off_t)req->offset, SEEK_SET) != 0)
+		{
+			*result = -1;
+			return 1;
+		}
+	}
+
+	/* the file keeps its read window, so a slice goes on from the data the last one fetched */
+	size = req->size - req->done;
+	if (size > WAF_ASYNC_SLICE)
+		size = WAF_ASYNC_SLICE;
+
+	status = waf_read(req->file, req->buff + req->done, &size);
+	if (status < 0)
+	{
+		*result = -1;
+		return 1;
+	}
+
+	req->done += size;
+	*result = 0;
+
+	return status == 1 || req->done >= req->size;
+}
+
+/*
+one pool job per queued request, each runs a slice of the most urgent
+request, so the order requests run in is set here and not by the pool
+*/
+static int waf_async_step(void)
+{
+	struct waf_request *req;
+	int result;
+	int complete;
+	int again = 0;
+
+	waf_mutex_lock(&waf_sched.lock);
+
+	req = waf_queue_first(WAF_PRIORITY_COUNT);
+	if (req)
+	{
+		waf_queue_remove(req);
+		req->state = WAF_REQUEST_RUNNING;
+
+		if (req->cancelled || waf_sched.stopping)
+		{
+			req->cancelled = 1;
+			waf_request_finish(req, WAF_CANCELLED);
+		}
+		else
+		{
+			waf_mutex_unlock(&waf_sched.lock);
+			complete = waf_request_step(req, &result);
+			waf_mutex_lock(&waf_sched.lock);
+
+			if (complete || req->cancelled || waf_sched.stopping)
+			{
+				if (!complete)
+					req->cancelled = 1;
+				waf_request_finish(req, result);
+			}
+			else
+			{
+				waf_queue_push(req, 1);  /* keeps its turn, but more urgent requests go first */
+				again = 1;
+			}
+		}
+	}
+
+	if (!again)
+	{
+		waf_sched.jobs--;
+		waf_cond_broadcast(&waf_sched.done);
+	}
+
+	waf_mutex_unlock(&waf_sched.lock);
+
+	return again;
+}
+
+static void waf_async_job(void *arg)
+{
+	(void)arg;
+
+	/* this job's count passes to the next one, or the work stays on this thread */
+	if (waf_async_step() && waf_pool_submit(waf_async_job, NULL) != 0)
+	{
+		while (waf_async_step())
+			;
+	}
+}
+
+int waf_async_start(unsigned threads)
+{
+	int status;
+
+	if (waf_sched_started)
+		return -1;
+
+	status = waf_pool_start(threads);
+	if (status < 0)
+		return -1;
+
+	memset(&waf_sched, 0, sizeof(waf_sched));
+	waf_mutex_init(&waf_sched.lock);
+	waf_cond_init(&waf_sched.done);
+	waf_sched.ownpool = (status == 0);
+
+	waf_sched_started = 1;
+
+	return 0;
+}
+
+void waf_async_stop(void)
+{
+	struct waf_request *req;
+
+	if (!waf_sched_started)
+		return;
+
+	/* whatever is still queued will not run, running requests stop at their next slice */
+	waf_mutex_lock(&waf_sched.lock);
+	waf_sched.stopping = 1;
+	while ((req = waf_queue_first(WAF_PRIORITY_COUNT)) != NULL)
+	{
+		waf_queue_remove(req);
+		req->state = WAF_REQUEST_RUNNING;
+		req->cancelled = 1;
+		waf_request_finish(req, WAF_CANCELLED);
+	}
+
+	while (waf_sched.jobs != 0)
+		waf_cond_wait(&waf_sched.done, &waf_sched.lock);
+	waf_mutex_unlock(&waf_sched.lock);
+
+	if (waf_sched.ownpool)
+		waf_pool_stop();
+
+	waf_cond_destroy(&waf_sched.done);
+	waf_mutex_destroy(&waf_sched.lock);
+
+	waf_sched_started = 0;
+}
+
+waf_request* waf_read_async(waf_archive *arc, waf_size_t id, waf_size_t offset, void *buff, waf_size_t size,
+	int priority, waf_read_callback callback, void *user)
+{
+	struct waf_request *req;
+
+	assert(arc != NULL);
+	assert(buff != NULL || size == 0);
+
+	if (!waf_sched_started || priority < 0 || priority >= WAF_PRIORITY_COUNT)
+		return NULL;
+
+	req = (struct waf_request*)malloc(sizeof(struct waf_request));
+	if (!req)
+		return NULL;
+	memset(req, 0, sizeof(struct waf_request));
+
+	req->arc = arc;
+	req->id = id;
+	req->offset = offset;
+	req->buff = (unsigned char*)buff;
+	req->size = size;
+	req->priority = priority;
+	req->callback = callback;
+	req->user = user;
+	req->refs = 2;
+
+	waf_mutex_lock(&waf_sched.lock);
+	waf_queue_push(req, 0);
+	waf_sched.jobs++;
+	waf_mutex_unlock(&waf_sched.lock);
+
+	/* an executor refusing work leaves the job to this thread */
+	if (waf_pool_submit(waf_async_job, NULL) != 0)
+	{
+		while (waf_async_step())
+			;
+	}
+
+	return req;
+}
+
+int waf_request_cancel(waf_request *req)
+{
+	int queued;
+
+	assert(req != NULL);
+
+	waf_mutex_lock(&waf_sched.lock);
+
+	queued = (req->state == WAF_REQUEST_QUEUED);
+	if (req->state != WAF_REQUEST_DONE)
+		req->cancelled = 1;
+
+	/* not started yet, complete it right here */
+	if (queued)
+	{
+		waf_queue_remove(req);
+		req->state = WAF_REQUEST_RUNNING;
+		waf_request_finish(req, WAF_CANCELLED);
+	}
+
+	waf_mutex_unlock(&waf_sched.lock);
+
+	return queued ? 0 : -1;
+}
+
+int waf_request_poll(waf_request *req, waf_size_t *size)
+{
+	int result = WAF_PENDING;
+
+	assert(req != NULL);
+
+	waf_mutex_lock(&waf_sched.lock);
+	if (req->state == WAF_REQUEST_DONE)
+	{
+		result = req->result;
+		if (size)
+			*size = req->done;
+	}
+	waf_mutex_unlock(&waf_sched.lock);
+
+	return result;
+}
+
+int waf_request_wait(waf_request *req, waf_size_t *size)
+{
+	int result;
+
+	assert(req != NULL);
+
+	waf_mutex_lock(&waf_sched.lock);
+	while (req->state != WAF_REQUEST_DONE)
+		waf_cond_wait(&waf_sched.done, &waf_sched.lock);
+
+	result = req->result;
+	if (size)
+		*size = req->done;
+	waf_mutex_unlock(&waf_sched.lock);
+
+	return result;
+}
+
+void waf_request_release(waf_request *req)
+{
+	if (!req)
+		return;
+
+	waf_mutex_lock(&waf_sched.lock);
+	waf_request_unref(req);
+	waf_mutex_unlock(&waf_sched.lock);
+}
@@ -29,9 +29,32 @@ wane <newsheep@gmail.com>
 #ifndef __WAF_CONF_H__
 #define __WAF_CONF_H__
 
-/* waf signature */
+/* waf signature, the high byte carries the archive flags */
 #define WAF_SIGNATURE 0x00666177UL
 
+/* archive flags */
+#define WAF_FLAG_DICT 0x01  /* blocks are compressed with a preset dictionary */
+#define WAF_FLAG_CHUNKS 0x02  /* files are lists of shared content-defined chunks */
+#define WAF_FLAG_DELTA 0x04  /* files may be stored as deltas against a base file */
+#define WAF_FLAG_EXTENT 0x08  /* index entries carry the compressed extent */
+#define WAF_FLAG_TRAILER 0x10  /* index follows the data, located by the trailer */
+#define WAF_FLAG_LARGE 0x20  /* offsets and file sizes are 64-bit */
+#define WAF_FLAG_INDEX 0x40  /* index is a packed table of sorted, front-coded names with a minimal perfect hash */
+#define WAF_FLAG_DIGEST 0x80  /* md5 of everything before it precedes the trailer */
+#define WAF_FLAGS_KNOWN (WAF_FLAG_DICT | WAF_FLAG_CHUNKS | WAF_FLAG_DELTA | WAF_FLAG_EXTENT | WAF_FLAG_TRAILER | WAF_FLAG_LARGE | WAF_FLAG_INDEX | WAF_FLAG_DIGEST)
+
+/* trailer signature, the archive ends with [digest][index offset][index size][signature] */
+#define WAF_DIGEST_SIZE 16
+#define WAF_TRAILER_SIGNATURE 0x65666177UL
+
+/* block types, stored in the high bits of the block size */
+#define WAF_BLOCK_DELTA 0x80000000UL  /* delta instructions against the base file */
+#define WAF_BLOCK_FILL 0x40000000UL  /* constant block, the low byte is the fill value, no data follows */
+#define WAF_BLOCK_TYPE_MASK (WAF_BLOCK_DELTA | WAF_BLOCK_FILL)
+
+/* max preset dictionary size, same as the deflate window */
+#define WAF_DICT_SIZE (32 * 1024)
+
 /* max filename size in archive */
 #define WAF_FILENAME_SIZE 260
 
@@ -39,8 +62,77 @@ wane <newsheep@gmail.com>
 #define WAF_BUFF_SIZE (64 * 1024)
 #define WAF_RAW_SIZE (68 * 1024)
 
+/* largest compressed extent fetched with a single read */
+#define WAF_WINDOW_SIZE (4 * 1024 * 1024)
+
+/* sources with batched reads get the window as segments of this size, and up to this many chunks at once */
+#define WAF_IO_SEGMENT (256 * 1024)
+#define WAF_BATCH_SIZE 32
+
+/* io_uring source: ring size, rings for overlapping batches and registered window buffers */
+#define WAF_URING_ENTRIES 64
+#define WAF_URING_RINGS 16
+#define WAF_URING_SLOTS 2
+
+/* async reads: bytes read before yielding to more urgent requests */
+#define WAF_ASYNC_SLICE (256 * 1024)
+
+/* job pool: most worker threads, jobs per worker deque (power of 2), cache line size */
+#define WAF_POOL_MAX_THREADS 64
+#define WAF_POOL_DEQUE 1024
+#define WAF_CACHE_LINE 64
+
+/* 64-bit seek */
+#ifdef _MSC_VER
+#define WAF_FSEEK(fp,offset,origin) _fseeki64((fp), (__int64)(offset), (origin))
+#define WAF_FTELL(fp) _ftelli64(fp)
+#define WAF_FLOCK(fp) _lock_file(fp)
+#define WAF_FUNLOCK(fp) _unlock_file(fp)
+#else
+#define WAF_FSEEK(fp,offset,origin) fseeko((fp), (off_t)(offset), (origin))
+#define WAF_FTELL(fp) ftello(fp)
+#define WAF_FLOCK(fp) flockfile(fp)
+#define WAF_FUNLOCK(fp) funlockfile(fp)
+#endif
+
+/* publishing data to lock-free readers */
+#ifdef _MSC_VER
+/* volatile accesses are acquire and release with /volatile:ms, the default on x86 and x64 */
+#define WAF_LOAD_ACQUIRE(var) (var)
+#define WAF_STORE_RELEASE(var,value) ((var) = (value))
+#else
+#define WAF_LOAD_ACQUIRE(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define WAF_STORE_RELEASE(var,value) __atomic_store_n(&(var), (value), __ATOMIC_RELEASE)
+#endif
+
+/* merged index of mounted archives, bloom filter bits per entry */
+#define WAF_MOUNT_BLOOM_BITS 10
+
+/* block cache: shards (power of 2), hint slots probed per lookup */
+#define WAF_CACHE_SHARDS 16
+#define WAF_CACHE_PROBES 8
+
+/* reader counters: threads with their own counters, later ones share one set */
+#define WAF_STATS_THREADS 256
+
+/* trace recorder: events kept when waf_trace_start is given 0, 48 bytes each */
+#define WAF_TRACE_EVENTS (1024 * 1024)
+
+/* shared memory cache segment tag, 'wafshm01' */
+#define WAF_SHM_MAGIC ((((waf_size_t)0x7761666dUL) << 32) | 0x73686d31UL)
+
+/*
+cache directory: block file tag 'wafb', seconds between refreshing a block's time, trims to 1 - 1/n of the cap,
+seconds before a temp file is taken as left by a crashed writer
+*/
+#define WAF_DISK_MAGIC 0x62666177UL
+#define WAF_DISK_TOUCH 60
+#define WAF_DISK_TRIM 10
+#define WAF_DISK_TMP_AGE 3600
+
 /* decompress procedure */
 #include "../zlib/zlib.h"
-#define WAF_DECOMPRESS(inbuf,insize,outbuf,outsize) (uncompress((outbuf), (uLongf*)&(outsize), (inbuf), (insize)) != Z_OK)
+#define WAF_DECOMPRESS(inbuf,insize,outbuf,outsize) (waf_uncompress_dict((outbuf), &(outsize), (inbuf), (insize), NULL, 0) != Z_OK)
+#define WAF_DECOMPRESS_DICT(inbuf,insize,outbuf,outsize,dict,dictsize) (waf_uncompress_dict((outbuf), &(outsize), (inbuf), (insize), (dict), (dictsize)) != Z_OK)
 
 #endif  /* __WAF_CONF_H__ */
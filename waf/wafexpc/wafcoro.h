@@ -0,0 +1,329 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+/*
+
+coroutine front-end for c++20, reads run on the async workers (waf_async_start)
+and the awaiting coroutine resumes on the caller's executor
+
+	waf::task<waf::buffer> load_level(waf_archive *arc, waf::executor *exec)
+	{
+		waf::buffer geo = co_await waf::load(arc, "level1/geo.bin", exec);
+		...
+	}
+
+	waf::buffer geo = waf::sync_wait(waf::load(arc, "level1/geo.bin"));
+
+tasks are lazy, they start when awaited. failures are thrown as std::runtime_error
+
+*/
+
+#ifndef __WAF_CORO_H__
+#define __WAF_CORO_H__
+
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "wafexp.h"
+
+namespace waf
+{
+
+typedef std::vector<unsigned char> buffer;
+
+/* where coroutines resume, such as a job system queue */
+class executor
+{
+public:
+	virtual ~executor() {}
+	virtual void post(std::coroutine_handle<> handle) = 0;
+};
+
+template <typename T>
+class task;
+
+namespace detail
+{
+
+/* resumes the awaiting coroutine when a task finishes */
+struct final_awaiter
+{
+	bool await_ready() noexcept { return false; }
+
+	template <typename Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+	{
+		std::coroutine_handle<> next = handle.promise().continuation;
+		return next ? next : std::noop_coroutine();
+	}
+
+	void await_resume() noexcept {}
+};
+
+struct promise_base
+{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base
+{
+	T value;
+
+	task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+
+	T result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base
+{
+	task<void> get_return_object();
+	void return_void() {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+}  /* namespace detail */
+
+/* lazy coroutine producing a T, owned by whoever holds it */
+template <typename T>
+class task
+{
+public:
+	typedef detail::promise<T> promise_type;
+
+	explicit task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+	task(task &&other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	~task()
+	{
+		if (_handle)
+			_handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		_handle.promise().continuation = awaiting;
+		return _handle;
+	}
+
+	T await_resume() { return _handle.promise().result(); }
+
+	/* runs the task without taking its result */
+	struct starter
+	{
+		std::coroutine_handle<promise_type> handle;
+
+		bool await_ready() const noexcept { return false; }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+		{
+			handle.promise().continuation = awaiting;
+			return handle;
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	starter start() noexcept { return starter{_handle}; }
+
+private:
+	std::coroutine_handle<promise_type> _handle;
+};
+
+namespace detail
+{
+
+template <typename T>
+inline task<T> promise<T>::get_return_object()
+{
+	return task<T>(std::coroutine_handle<promise<T> >::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+	return task<void>(std::coroutine_handle<promise<void> >::from_promise(*this));
+}
+
+/* suspends until an async read completes */
+class read_awaiter
+{
+public:
+	read_awaiter(waf_archive *arc, waf_size_t id, void *buff, waf_size_t size, int priority, executor *exec)
+		: _arc(arc), _id(id), _buff(buff), _size(size), _priority(priority), _exec(exec), _result(-1) {}
+
+	bool await_ready() const noexcept { return _size == 0; }
+
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		_handle = handle;
+
+		/* the callback may run and resume before this returns, so the handle is not kept */
+		if (!waf_read_async(_arc, _id, 0, _buff, _size, _priority, &read_awaiter::completed, this))
+		{
+			_result = -1;
+			return false;
+		}
+
+		return true;
+	}
+
+	void await_resume() const
+	{
+		if (_size != 0 && _result != 0)
+			throw std::runtime_error(_result == WAF_CANCELLED ? "read cancelled" : "read failed");
+	}
+
+private:
+	static void completed(waf_request *req, int result, waf_size_t size, void *user)
+	{
+		read_awaiter *self = static_cast<read_awaiter*>(user);
+
+		waf_request_release(req);
+		self->_result = (result == 0 && size != self->_size) ? -1 : result;
+
+		if (self->_exec)
+			self->_exec->post(self->_handle);
+		else
+			self->_handle.resume();
+	}
+
+	waf_archive *_arc;
+	waf_size_t _id;
+	void *_buff;
+	waf_size_t _size;
+	int _priority;
+	executor *_exec;
+	int _result;
+	std::coroutine_handle<> _handle;
+};
+
+}  /* namespace detail */
+
+/*
+read a whole file
+parameters:
+	[in] arc - pointer to an opened archive, kept open until the task completes
+	[in] filename - name of the file, the task keeps its own copy
+	[in] exec - where the awaiting coroutine resumes, NULL resumes on the worker
+	[in] priority - WAF_PRIORITY_xxx
+returns:
+	task producing the contents of the file
+*/
+inline task<buffer> load(waf_archive *arc, std::string filename, executor *exec = nullptr,
+	int priority = WAF_PRIORITY_NORMAL)
+{
+	waf_size_t id = waf_find(arc, filename.c_str());
+	if (id == WAF_NO_ID)
+		throw std::runtime_error("file not found");
+
+	buffer data((size_t)waf_size_id(arc, id));
+	co_await detail::read_awaiter(arc, id, data.data(), data.size(), priority, exec);
+
+	co_return data;
+}
+
+/*
+run a task to completion on this thread's behalf, blocking until it finishes
+parameters:
+	[in] t - task to run
+returns:
+	result of the task
+*/
+template <typename T>
+T sync_wait(task<T> t)
+{
+	struct waiter
+	{
+		std::mutex lock;
+		std::condition_variable cond;
+		bool done;
+	} w;
+
+	struct runner
+	{
+		struct promise_type
+		{
+			runner get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	w.done = false;
+
+	auto run = [&]() -> runner
+	{
+		co_await t.start();
+
+		std::lock_guard<std::mutex> guard(w.lock);
+		w.done = true;
+		w.cond.notify_one();
+	};
+
+	run();
+
+	std::unique_lock<std::mutex> guard(w.lock);
+	w.cond.wait(guard, [&] { return w.done; });
+	guard.unlock();
+
+	return t.await_resume();
+}
+
+}  /* namespace waf */
+
+#endif  /* __WAF_CORO_H__ */
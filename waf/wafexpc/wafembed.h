@@ -0,0 +1,93 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+/*
+
+archive embedded in the executable image (gcc or clang, ELF targets)
+
+the archive is linked into a read-only section and opened in place with
+waf_archive_open_memory, pages are loaded by the kernel as they are read
+
+	WAF_EMBED(assets, "assets.waf")  -- at file scope, once per program
+
+	waf_archive *arc = WAF_EMBED_OPEN(assets);
+
+the path is searched by the assembler, add -Wa,-I<dir> when the archive
+is not next to the source or in the working directory. an object made by
+
+	objcopy -I binary -O elf64-x86-64 -B i386:x86-64 \
+		--rename-section .data=.rodata,alloc,load,readonly,data,contents \
+		assets.waf assets.o
+
+exports _binary_assets_waf_start and _binary_assets_waf_end instead, open
+it with WAF_EMBED_OPEN_RANGE on those two symbols
+
+*/
+
+#ifndef __WAF_EMBED_H__
+#define __WAF_EMBED_H__
+
+#include "wafexp.h"
+
+#ifdef __cplusplus
+#define WAF_EMBED_EXTERN extern "C"
+#else
+#define WAF_EMBED_EXTERN extern
+#endif
+
+/* declare the bounds of an embedded archive, such as the objcopy symbols */
+#define WAF_EMBED_DECLARE(start, end) \
+	WAF_EMBED_EXTERN const unsigned char start[]; \
+	WAF_EMBED_EXTERN const unsigned char end[]
+
+#define WAF_EMBED_OPEN_RANGE(start, end) waf_archive_open_memory((start), (waf_size_t)((end) - (start)))
+
+#if defined(__GNUC__) && defined(__ELF__)
+
+#define WAF_EMBED(name, path) \
+	__asm__(".pushsection .rodata.waf_" #name ", \"a\", @progbits\n" \
+		".balign 16\n" \
+		".globl waf_embed_" #name "\n" \
+		".type waf_embed_" #name ", @object\n" \
+		"waf_embed_" #name ":\n" \
+		".incbin \"" path "\"\n" \
+		".globl waf_embed_" #name "_end\n" \
+		"waf_embed_" #name "_end:\n" \
+		".size waf_embed_" #name ", waf_embed_" #name "_end - waf_embed_" #name "\n" \
+		".popsection\n"); \
+	WAF_EMBED_DECLARE(waf_embed_##name, waf_embed_##name##_end)
+
+/* use in other files than the one with WAF_EMBED */
+#define WAF_EMBED_EXTERN_ARCHIVE(name) WAF_EMBED_DECLARE(waf_embed_##name, waf_embed_##name##_end)
+
+#define WAF_EMBED_OPEN(name) WAF_EMBED_OPEN_RANGE(waf_embed_##name, waf_embed_##name##_end)
+
+#endif  /* __GNUC__ && __ELF__ */
+
+#endif  /* __WAF_EMBED_H__ */
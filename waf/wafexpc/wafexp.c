@@ -26,6 +26,13 @@ wane <newsheep@gmail.com>
 
 */
 
+/* 64-bit file offsets on 32-bit posix systems, stdio locking */
+#ifndef _MSC_VER
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -35,6 +42,23 @@ wane <newsheep@gmail.com>
 
 #include "wafexp.h"
 #include "wafconf.h"
+#include "wafthread.h"
+#include "wafstats.h"
+#include "waftrace.h"
+
+/* shared memory block cache */
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
 
 #ifdef _MSC_VER
 #pragma warning(push)
@@ -42,13 +66,172 @@ wane <newsheep@gmail.com>
 #endif
 
 #define WAF_MIN(a,b) ((a) < (b) ? (a) : (b))
+#define WAF_U32_SIZE 4  /* size of a 32-bit field on disk */
+#define WAF_U64_SIZE 8
+#define WAF_OFF_SIZE(arc) (((arc)->flags & WAF_FLAG_LARGE) ? WAF_U64_SIZE : WAF_U32_SIZE)  /* size of offsets and file sizes on disk */
+#define WAF_PAYLOAD(bs) (((bs) & WAF_BLOCK_FILL) ? 0 : ((bs) & ~WAF_BLOCK_TYPE_MASK))  /* data bytes after a block size */
 #define WAF_U32(arr) (((arr)[0]) + ((waf_size_t)(arr)[1] << 8) + ((waf_size_t)(arr)[2] << 16) + ((waf_size_t)(arr)[3] << 24))
+#define WAF_U64(arr) (WAF_U32(arr) + (WAF_U32(&(arr)[4]) << 32))
+#define WAF_OFF(arc,arr) (((arc)->flags & WAF_FLAG_LARGE) ? WAF_U64(arr) : WAF_U32(arr))
 
 /* read next block result */
 #define READ_STATUS_SUCCESS 0
 #define READ_STATUS_FAILED 1
 #define READ_STATUS_EOF 2
 
+/* packed index layout */
+#define WAF_INDEX_HEADER_SIZE (WAF_U32_SIZE * 4)  /* [name count][bucket count][data count][names size] */
+#define WAF_DATA_SIZE (WAF_U64_SIZE * 3)  /* [size][offset][extent] */
+#define WAF_RESTART_INTERVAL 16  /* every 16th name is stored whole */
+#define WAF_RESTARTS(count) (((count) + WAF_RESTART_INTERVAL - 1) / WAF_RESTART_INTERVAL)
+#define WAF_CONST64(hi,lo) (((waf_size_t)(hi) << 32) | (waf_size_t)(lo))
+#define WAF_HASH_GOLDEN WAF_CONST64(0x9e3779b9, 0x7f4a7c15)
+
+/* delta block instructions */
+#define WAF_DELTA_COPY 'c'  /* copy [u32 position][u32 length] from the base file */
+#define WAF_DELTA_ADD 'a'  /* append [u32 length][data] */
+
+/* a name in the merged index of a mount */
+struct waf_mount_slot
+{
+	waf_size_t hash;  /* name hash, valid when arc is set */
+	struct waf_archive *arc;
+	waf_size_t id;
+};
+
+/* merged index, never changed once published */
+struct waf_mount_table
+{
+	waf_size_t mask;  /* slot count - 1 */
+	struct waf_mount_slot *slots;
+	waf_size_t bloommask;  /* bloom filter bit count - 1 */
+	unsigned char *bloom;
+	waf_size_t entries;
+	struct waf_mount_table *prev;  /* replaced table, freed with the mount */
+};
+
+struct waf_mount
+{
+	struct waf_mount_table *volatile table;
+};
+
+/* block cache hint table entries, [16-bit hash tag][16-bit block index + 1] */
+#define WAF_CACHE_TAG(h) ((unsigned long)((h) >> 48))
+#define WAF_CACHE_ENTRY(tag,index) (((tag) << 16) | ((unsigned long)(index) + 1))
+#define WAF_CACHE_BUSY 0x80000000UL  /* block state while it is filled or evicted */
+#define WAF_CACHE_MAX_BLOCKS 0xffffUL  /* per shard */
+
+/* a decompressed block, found by archive serial and block offset */
+struct waf_cache_block
+{
+	volatile unsigned long state;  /* pin count, or WAF_CACHE_BUSY */
+	volatile unsigned long used;  /* clock reference bit */
+	unsigned long serial;  /* archive serial */
+	waf_size_t offset;  /* block offset in the archive */
+	waf_size_t size;  /* decompressed size */
+	waf_size_t payload;  /* compressed bytes after the block size */
+	unsigned long slot;  /* hint table slot, valid while the block is cached */
+	unsigned char *data;  /* allocated when first filled, freed when the hot tier shrinks */
+};
+
+/* a compressed block in the cold tier */
+struct waf_cache_cold
+{
+	struct waf_cache_cold *next;  /* hash chain */
+	struct waf_cache_cold *ring;  /* clock ring */
+	unsigned long serial;
+	waf_size_t offset;
+	waf_size_t word;  /* block size word, with the block type */
+	waf_size_t payload;
+	int used;
+	unsigned char data[1];
+};
+
+/*
+lookups only read the hint table and pin a block with an atomic increment,
+the lock is taken by inserts to run the clock and update the hints
+*/
+struct waf_cache_shard
+{
+	waf_mutex_t lock;
+	unsigned long hand;  /* clock hand */
+	unsigned long nblocks;
+	struct waf_cache_block *blocks;
+	volatile unsigned long *hints;
+	unsigned long hintmask;  /* hint count - 1 */
+
+	/* memory budget, the hot target moves with the hit rates of the tiers */
+	waf_size_t budget;
+	waf_size_t hottarget;
+	waf_size_t hotbytes;
+	waf_size_t coldbytes;
+
+	/* cold tier, only touched with the lock held */
+	struct waf_cache_cold **cold;
+	unsigned long coldmask;  /* bucket count - 1 */
+	struct waf_cache_cold *coldhand;  /* precedes the next block the clock looks at */
+	waf_size_t *ghosts;  /* hashes of blocks evicted from the cold tier */
+};
+
+/*
+slot of the shared memory cache. lock holds a sequence in the low 32 bits,
+odd while a process writes the slot, and that process id in the high bits,
+so a slot left behind by a crashed writer can be taken over. readers copy
+the block and check the sequence did not move, they hold nothing
+*/
+struct waf_shm_slot
+{
+	volatile waf_size_t lock;
+	volatile waf_size_t used;  /* clock reference bit */
+	waf_size_t ident;  /* archive identity, 0 if empty */
+	waf_size_t offset;
+	waf_size_t size;
+	waf_size_t payload;
+};
+
+struct waf_shm_header
+{
+	volatile waf_size_t magic;  /* set last by the process creating the segment */
+	waf_size_t nsets;
+	waf_size_t blocksize;
+};
+
+struct waf_shm
+{
+	void *base;
+	waf_size_t mapsize;
+	waf_size_t nsets;  /* sets of WAF_CACHE_PROBES slots */
+	struct waf_shm_slot *slots;
+	unsigned char *data;
+};
+
+/* block files of a cache directory: [u32 magic][u32 size][u32 payload][u32 reserved][data] */
+#define WAF_DISK_HEADER_SIZE (WAF_U32_SIZE * 4)
+#define WAF_DISK_NAME_SIZE 40  /* 16 hex digits, '-', 16 hex digits, ".wblk" */
+
+/* cache directory, kept across runs */
+struct waf_disk
+{
+	char *dir;
+	waf_mutex_t lock;  /* trimming */
+	waf_size_t capacity;
+	waf_size_t bytes;  /* estimated directory size, exact after a trim */
+};
+
+struct waf_cache
+{
+	struct waf_cache_shard *shards[WAF_CACHE_SHARDS];
+	int tiered;
+	struct waf_shm *shm;  /* shared by processes, instead of the shards */
+	struct waf_disk *disk;  /* kept on disk, instead of the shards */
+};
+
+/* serial numbers of opened archives, cached blocks outlive the archive pointers */
+static volatile unsigned long waf_archive_serial = 0;
+
+/* the iterator of the public header must hold any entry name */
+typedef char waf_iter_name_check[sizeof(((waf_iter*)0)->name) >= WAF_FILENAME_SIZE ? 1 : -1];
+
 /* archive file info */
 struct waf_inf
 {
@@ -56,32 +239,88 @@ struct waf_inf
 	waf_size_t hash;    /* hash for the filename */
 	waf_size_t size;    /* uncompressed size */
 	waf_size_t offset;  /* offset in archive file */
+	waf_size_t extent;  /* compressed bytes from offset to the end of the file's data, 0 if unknown */
+};
+
+/* archive data held in the window */
+struct waf_span
+{
+	waf_size_t start;  /* archive offset */
+	waf_size_t size;
+	const unsigned char *data;
 };
 
 /* archive file struct */
 struct waf_file
 {
-	FILE *fp;
+	struct waf_archive *arc;  /* owner archive */
+	waf_size_t id;  /* entry id, WAF_NO_ID for base files */
 	waf_size_t cur;  /* current position */
 	waf_size_t cp;  /* current block offset */
 	waf_size_t np;  /* next block offset */
-	struct waf_inf *inf;
+	waf_size_t nb;  /* next block index */
+	waf_size_t blocks;  /* block count */
+	struct waf_inf inf;
 
 	unsigned char cdata[WAF_BUFF_SIZE];  /* buffered data */
+	const unsigned char *cbuf;  /* data of the current block, cdata or a cached block */
+	struct waf_cache_block *pinned;  /* cached block in use */
+	void *mapped;  /* mapped block file in use, disk caches only */
+	waf_size_t mappedsize;
 	waf_size_t coff;  /* current buffer position */
 	waf_size_t csize;  /* current buffer size */
 
 	waf_size_t *fast_offset;  /* fast seek offsets */
+	waf_size_t *chunk_start;  /* uncompressed start of each chunk, chunked archives only */
+
+	waf_size_t base_ref;  /* base file, data record + 1 with a packed index, otherwise its offset, 0 if none */
+	struct waf_file *base;  /* base file, opened by the first delta block */
+	unsigned char *dbuf;  /* delta instructions */
+
+	unsigned char *window;  /* compressed data fetched by a large read */
+	struct waf_span spans[WAF_BATCH_SIZE];  /* the extent, or a batch of chunks */
+	waf_size_t nspans;
 };
 
 /* archive struct */
 struct waf_archive
 {
-	FILE *fp;  /* pointer to the archive file */
+	waf_io io;  /* where the archive is read from */
+	const unsigned char *mem;  /* whole source, memory archives only */
+	waf_size_t memsize;
+	waf_size_t base;  /* archive start offset in the file */
+	waf_size_t flags;  /* WAF_FLAG_xxx */
 	waf_size_t count;  /* file count */
-	struct waf_inf **infs;  /* file info array */
+	struct waf_inf **infs;  /* file info array, archives without a packed index */
+
+	/* packed index, used as read from the archive, in place for memory archives */
+	const unsigned char *index;
+	unsigned char *indexbuf;  /* copy of the index read from the source, NULL for memory archives */
+	waf_size_t nbuckets;
+	waf_size_t ndata;
+	const unsigned char *disp;  /* hash displacement of each bucket */
+	const unsigned char *slots;  /* entry id of each hash slot */
+	const unsigned char *refs;  /* data record of each entry */
+	const unsigned char *data;  /* data records, shared by aliases */
+	const unsigned char *restarts;  /* offset of every WAF_RESTART_INTERVAL-th name */
+	const unsigned char *names;  /* sorted names, front-coded */
+	waf_size_t namesize;
+
+	unsigned char *dict;  /* preset dictionary shared by all blocks */
+	waf_size_t dictsize;
+
+	struct waf_cache *cache;  /* decompressed blocks, may be shared by archives */
+	unsigned long serial;
+	waf_size_t ident;  /* content identity for caches outside the process, 0 until needed */
+	unsigned char digest[WAF_DIGEST_SIZE];  /* archives with WAF_FLAG_DIGEST only */
+
+	FILE *record;  /* access trace, see waf_archive_record */
+	waf_mutex_t recordlock;
+	waf_size_t recordstart;  /* clock when recording started */
 };
 
+int waf_seekabs(struct waf_file *file, waf_size_t position);
+
 /* string hash (borrowed from bkdr hash) */
 static waf_size_t waf_strhash(const char *str)
 {
@@ -98,52 +337,372 @@ static waf_size_t waf_strhash(const char *str)
 	return hash & 0x7fffffff;
 }
 
-/* read a waf_size_t from file */
-static int waf_readsize(FILE *fp, waf_size_t *data)
+/* name hash of the packed index (64-bit fnv-1a) */
+static waf_size_t waf_namehash(const char *str)
+{
+	waf_size_t hash = WAF_CONST64(0xcbf29ce4, 0x84222325);
+
+	while (*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= WAF_CONST64(0x100, 0x000001b3);
+	}
+
+	return hash;
+}
+
+/* continue a 64-bit fnv-1a hash over bytes */
+static waf_size_t waf_datahash(waf_size_t hash, const void *data, waf_size_t size)
+{
+	const unsigned char *p = (const unsigned char*)data;
+
+	while (size--)
+	{
+		hash ^= *p++;
+		hash *= WAF_CONST64(0x100, 0x000001b3);
+	}
+
+	return hash;
+}
+
+/* 64-bit finalizer, spreads a displaced name hash over the slots */
+static waf_size_t waf_mix(waf_size_t h)
+{
+	h ^= h >> 33;
+	h *= WAF_CONST64(0xff51afd7, 0xed558ccd);
+	h ^= h >> 33;
+	h *= WAF_CONST64(0xc4ceb9fe, 0x1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* read archive bytes at a position of the source */
+static int waf_pread(struct waf_archive *arc, waf_size_t pos, void *dst, waf_size_t len)
+{
+	waf_stats *stats;
+	waf_size_t start;
+	int result;
+
+	if (arc->mem)
+	{
+		if (pos > arc->memsize || len > arc->memsize - pos)
+			return -1;
+
+		memcpy(dst, &arc->mem[pos], (size_t)len);
+		return 0;
+	}
+
+	stats = waf_stats_local();
+	start = waf_clock();
+
+	WAF_PROBE2(io_start, pos, len);
+	result = arc->io.read_at(arc->io.user, pos, dst, len) == len ? 0 : -1;
+	WAF_PROBE3(io_end, pos, len, result);
+
+	stats->io_reads++;
+	stats->io_bytes += len;
+	stats->io_ns += waf_stats_time(stats, WAF_OP_IO, start);
+	WAF_TRACE_SPAN(WAF_EVENT_IO, start, pos, len);
+
+	return result;
+}
+
+/* read a waf_size_t at pos and move past it */
+static int waf_readsize(struct waf_archive *arc, waf_size_t *pos, waf_size_t *data)
 {
-	unsigned char buff[sizeof(waf_size_t)];
+	unsigned char buff[WAF_U32_SIZE];
 
-	if (fread(buff, 1, sizeof(waf_size_t), fp) != sizeof(waf_size_t) || ferror(fp))
+	if (waf_pread(arc, *pos, buff, WAF_U32_SIZE) != 0)
 		return -1;
 
 	*data = WAF_U32(buff);
+	*pos += WAF_U32_SIZE;
 
 	return 0;
 }
 
-struct waf_archive* waf_archive_open(const char *filename, waf_size_t offset)
+/* read an offset or file size, 64-bit in large archives */
+static int waf_readoff(struct waf_archive *arc, waf_size_t *pos, waf_size_t *data)
 {
-	struct waf_archive *arc = NULL;
-	unsigned char signature[sizeof(waf_size_t) * 3] = {0};
+	unsigned char buff[WAF_U64_SIZE];
+
+	if (waf_pread(arc, *pos, buff, WAF_OFF_SIZE(arc)) != 0)
+		return -1;
+
+	*data = WAF_OFF(arc, buff);
+	*pos += WAF_OFF_SIZE(arc);
+
+	return 0;
+}
+
+/* read several ranges, in one batch when the source supports it */
+static int waf_pread_batch(struct waf_archive *arc, waf_io_req *reqs, waf_size_t count)
+{
+	waf_stats *stats;
+	waf_size_t start;
+	waf_size_t bytes = 0;
 	waf_size_t i;
+	int result;
 
-	assert(filename != NULL);
-	assert(offset >= 0);
+	if (arc->io.read_batch)
+	{
+		stats = waf_stats_local();
+		start = waf_clock();
+
+		for (i = 0; i < count; i++)
+			bytes += reqs[i].len;
+
+		WAF_PROBE2(batch_start, count, bytes);
+		result = arc->io.read_batch(arc->io.user, reqs, count);
+		WAF_PROBE3(batch_end, count, bytes, result);
+
+		stats->io_reads += count;
+		stats->io_bytes += bytes;
+		stats->io_ns += waf_stats_time(stats, WAF_OP_IO, start);
+		WAF_TRACE_SPAN(WAF_EVENT_IO, start, count ? reqs[0].pos : 0, bytes);
+
+		return result;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (waf_pread(arc, reqs[i].pos, reqs[i].buff, reqs[i].len) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* buffers for data read from the source, the source may provide registered memory */
+static void* waf_buf_alloc(struct waf_archive *arc, waf_size_t size)
+{
+	if (arc->io.alloc)
+		return arc->io.alloc(arc->io.user, size);
+
+	return malloc((size_t)size);
+}
+
+static void waf_buf_free(struct waf_archive *arc, void *ptr)
+{
+	if (arc->io.alloc)
+		arc->io.free(arc->io.user, ptr);
+	else
+		free(ptr);
+}
+
+/* stdio source of archives opened by filename */
+static waf_size_t waf_stdio_read(void *user, waf_size_t pos, void *buff, waf_size_t len)
+{
+	FILE *fp = (FILE*)user;
+	waf_size_t got = 0;
+
+	/* files of one archive may be read on several threads */
+	WAF_FLOCK(fp);
+	if (WAF_FSEEK(fp, pos, SEEK_SET) == 0)
+		got = fread(buff, 1, (size_t)len, fp);
+	WAF_FUNLOCK(fp);
+
+	return got;
+}
+
+static waf_size_t waf_stdio_size(void *user)
+{
+	FILE *fp = (FILE*)user;
+
+	if (WAF_FSEEK(fp, 0, SEEK_END) != 0)
+		return 0;
+
+	return (waf_size_t)WAF_FTELL(fp);
+}
+
+static void waf_stdio_close(void *user)
+{
+	fclose((FILE*)user);
+}
+
+/* uncompress a block, optionally stored with a preset dictionary */
+static int waf_uncompress_dict(unsigned char *dest, waf_size_t *destlen, const unsigned char *source, waf_size_t sourcelen,
+	const unsigned char *dict, waf_size_t dictsize)
+{
+	z_stream stream;
+	int err;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.next_in = (Bytef*)source;
+	stream.avail_in = (uInt)sourcelen;
+	stream.next_out = dest;
+	stream.avail_out = (uInt)*destlen;
+
+	err = inflateInit(&stream);
+	if (err != Z_OK)
+		return err;
+
+	err = inflate(&stream, Z_FINISH);
+	if (err == Z_NEED_DICT && dict)
+	{
+		/* the block asks for the archive dictionary, feed it and go on */
+		err = inflateSetDictionary(&stream, dict, (uInt)dictsize);
+		if (err == Z_OK)
+			err = inflate(&stream, Z_FINISH);
+	}
+
+	*destlen = stream.total_out;
+	inflateEnd(&stream);
+
+	return err == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+}
+
+/* read the packed index in one go, or use it in place in memory, nothing is parsed per entry */
+static int waf_load_index(struct waf_archive *arc, waf_size_t pos, waf_size_t size)
+{
+	waf_size_t expect;
+
+	if (size < WAF_INDEX_HEADER_SIZE)
+		return -1;
+
+	if (arc->mem)
+	{
+		if (pos > arc->memsize || size > arc->memsize - pos)
+			return -1;
+
+		arc->index = &arc->mem[pos];
+	}
+	else
+	{
+		arc->indexbuf = (unsigned char*)malloc((size_t)size);
+		if (!arc->indexbuf)
+			return -1;
+
+		if (waf_pread(arc, pos, arc->indexbuf, size) != 0)
+			return -1;
+
+		arc->index = arc->indexbuf;
+	}
+
+	if (WAF_U32(arc->index) != arc->count)
+		return -1;
+
+	arc->nbuckets = WAF_U32(&arc->index[WAF_U32_SIZE]);
+	arc->ndata = WAF_U32(&arc->index[WAF_U32_SIZE * 2]);
+	arc->namesize = WAF_U32(&arc->index[WAF_U32_SIZE * 3]);
+
+	expect = WAF_INDEX_HEADER_SIZE + (arc->nbuckets + arc->count * 2 + WAF_RESTARTS(arc->count)) * WAF_U32_SIZE +
+		arc->ndata * WAF_DATA_SIZE + arc->namesize;
+	if (arc->nbuckets == 0 || expect != size)
+		return -1;
+
+	arc->disp = arc->index + WAF_INDEX_HEADER_SIZE;
+	arc->slots = arc->disp + arc->nbuckets * WAF_U32_SIZE;
+	arc->refs = arc->slots + arc->count * WAF_U32_SIZE;
+	arc->data = arc->refs + arc->count * WAF_U32_SIZE;
+	arc->restarts = arc->data + arc->ndata * WAF_DATA_SIZE;
+	arc->names = arc->restarts + WAF_RESTARTS(arc->count) * WAF_U32_SIZE;
+
+	return 0;
+}
+
+/* open an archive on a source, the source is closed with the archive only on success */
+static struct waf_archive* waf_archive_load(const waf_io *io, const unsigned char *mem, waf_size_t memsize, waf_size_t offset)
+{
+	struct waf_archive *arc = NULL;
+	unsigned char signature[WAF_U32_SIZE * 3] = {0};
+	unsigned char trailer[WAF_U64_SIZE * 2 + WAF_U32_SIZE];
+	waf_size_t trailersize;
+	waf_size_t indexsize = 0;
+	waf_size_t sourcesize;
+	waf_size_t pos = offset;
+	waf_size_t i;
 
 	arc = (struct waf_archive*)malloc(sizeof(struct waf_archive));
 	if (!arc)
 		goto __error;
 
-	arc->fp = NULL;
+	arc->io = *io;
+	arc->io.close = NULL;  /* taken over on success */
+	arc->mem = mem;
+	arc->memsize = memsize;
+	arc->base = offset;
 	arc->infs = NULL;
-
-	arc->fp = fopen(filename, "rb");
-	if (!arc->fp)
-		goto __error;
-
-	fseek(arc->fp, (long)offset, SEEK_SET);
+	arc->index = NULL;
+	arc->indexbuf = NULL;
+	arc->dict = NULL;
+	arc->dictsize = 0;
+	arc->cache = NULL;
+	arc->serial = WAF_ATOMIC_ADD(waf_archive_serial, 1);
+	arc->ident = 0;
+	arc->record = NULL;
+	waf_mutex_init(&arc->recordlock);
 
 	/* read signature */
-	if (fread(signature, 1, sizeof(signature), arc->fp) != sizeof(signature) ||
-		ferror(arc->fp))
+	if (waf_pread(arc, pos, signature, sizeof(signature)) != 0)
 		goto __error;
+	pos += sizeof(signature);
 
-	if (WAF_U32(signature) != WAF_SIGNATURE)
+	/* the last byte of the tag holds the archive flags */
+	if ((WAF_U32(signature) & 0x00ffffffUL) != WAF_SIGNATURE)
 		goto __error;  /* bad tag */
-	if (WAF_U32(&signature[sizeof(waf_size_t)]) != WAF_BUFF_SIZE)
+	arc->flags = signature[3];
+	if (arc->flags & ~WAF_FLAGS_KNOWN)
+		goto __error;  /* archive needs a newer reader */
+	if ((arc->flags & WAF_FLAG_CHUNKS) && (arc->flags & WAF_FLAG_DELTA))
+		goto __error;  /* not supported together */
+	if ((arc->flags & WAF_FLAG_DELTA) && !(arc->flags & WAF_FLAG_INDEX))
+		goto __error;  /* deltas name their base by its data record in the index */
+	if ((arc->flags & (WAF_FLAG_INDEX | WAF_FLAG_DIGEST)) && !(arc->flags & WAF_FLAG_TRAILER))
+		goto __error;  /* packed index size and the digest come with the trailer */
+	if (WAF_U32(&signature[WAF_U32_SIZE]) != WAF_BUFF_SIZE)
 		goto __error;  /* bad block size */
 	
-	arc->count = WAF_U32(&signature[sizeof(waf_size_t) * 2]);
+	arc->count = WAF_U32(&signature[WAF_U32_SIZE * 2]);
+
+	if (arc->flags & WAF_FLAG_DICT)
+	{
+		/* preset dictionary follows the signature */
+		if (waf_readsize(arc, &pos, &arc->dictsize) != 0 || arc->dictsize == 0 || arc->dictsize > WAF_DICT_SIZE)
+			goto __error;
+
+		arc->dict = (unsigned char*)malloc(arc->dictsize);
+		if (!arc->dict)
+			goto __error;
+
+		if (waf_pread(arc, pos, arc->dict, arc->dictsize) != 0)
+			goto __error;
+		pos += arc->dictsize;
+	}
+
+	if (arc->flags & WAF_FLAG_TRAILER)
+	{
+		/* index follows the data, the trailer at the end of the file points to it */
+		trailersize = WAF_OFF_SIZE(arc) * 2 + WAF_U32_SIZE;
+		sourcesize = mem ? memsize : io->size(io->user);
+		if (sourcesize < offset + trailersize)
+			goto __error;
+
+		if (waf_pread(arc, sourcesize - trailersize, trailer, trailersize) != 0)
+			goto __error;
+
+		if (WAF_U32(&trailer[WAF_OFF_SIZE(arc) * 2]) != WAF_TRAILER_SIGNATURE)
+			goto __error;  /* truncated archive */
+
+		pos = WAF_OFF(arc, trailer) + offset;
+		indexsize = WAF_OFF(arc, &trailer[WAF_OFF_SIZE(arc)]);
+
+		if (arc->flags & WAF_FLAG_DIGEST)
+		{
+			if (sourcesize < offset + trailersize + WAF_DIGEST_SIZE ||
+				waf_pread(arc, sourcesize - trailersize - WAF_DIGEST_SIZE, arc->digest, WAF_DIGEST_SIZE) != 0)
+				goto __error;
+		}
+	}
+
+	if (arc->flags & WAF_FLAG_INDEX)
+	{
+		if (waf_load_index(arc, pos, indexsize) != 0)
+			goto __error;
+
+		goto __finish;
+	}
 
 	if (arc->count > 0)
 		arc->infs = (struct waf_inf**)malloc(sizeof(struct waf_inf*) * arc->count);
@@ -162,23 +721,29 @@ struct waf_archive* waf_archive_open(const char *filename, waf_size_t offset)
 			goto __error;
 
 		/* size of filename */
-		if (waf_readsize(arc->fp, &size) != 0 || size > WAF_FILENAME_SIZE)
+		if (waf_readsize(arc, &pos, &size) != 0 || size >= WAF_FILENAME_SIZE)
 			goto __error;
 
 		/* read filename */
-		if (fread(inf->name, 1, size, arc->fp) != size || ferror(arc->fp))
+		if (waf_pread(arc, pos, inf->name, size) != 0)
 			goto __error;
+		pos += size;
 		inf->name[size] = 0;
 		inf->hash = waf_strhash(inf->name);
 
 		/* read uncompressed file size */
-		if (waf_readsize(arc->fp, &inf->size) != 0)
+		if (waf_readoff(arc, &pos, &inf->size) != 0)
 			goto __error;
 
 		/* read file offset */
-		if (waf_readsize(arc->fp, &inf->offset) != 0)
+		if (waf_readoff(arc, &pos, &inf->offset) != 0)
 			goto __error;
 		inf->offset += offset;
+
+		/* read compressed extent */
+		inf->extent = 0;
+		if ((arc->flags & WAF_FLAG_EXTENT) && waf_readoff(arc, &pos, &inf->extent) != 0)
+			goto __error;
 	}
 
 	goto __finish;
@@ -191,9 +756,59 @@ __error:
 	}
 	
 __finish:
+	if (arc)
+		arc->io.close = io->close;
+
+	return arc;
+}
+
+struct waf_archive* waf_archive_open(const char *filename, waf_size_t offset)
+{
+	struct waf_archive *arc;
+	waf_io io;
+	FILE *fp;
+
+	assert(filename != NULL);
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return NULL;
+
+	memset(&io, 0, sizeof(io));
+	io.user = fp;
+	io.read_at = waf_stdio_read;
+	io.size = waf_stdio_size;
+	io.close = waf_stdio_close;
+
+	arc = waf_archive_load(&io, NULL, 0, offset);
+	if (!arc)
+		fclose(fp);
+
 	return arc;
 }
 
+struct waf_archive* waf_archive_open_io(const waf_io *io, waf_size_t offset)
+{
+	assert(io != NULL);
+	assert(io->read_at != NULL);
+	assert(io->size != NULL);
+	assert(!io->alloc == !io->free);
+
+	return waf_archive_load(io, NULL, 0, offset);
+}
+
+struct waf_archive* waf_archive_open_memory(const void *data, waf_size_t size)
+{
+	waf_io io;
+
+	assert(data != NULL);
+
+	/* no callbacks, every read is served from the memory */
+	memset(&io, 0, sizeof(io));
+
+	return waf_archive_load(&io, (const unsigned char*)data, size, 0);
+}
+
 void waf_archive_close(struct waf_archive *arc)
 {
 	waf_size_t i;
@@ -201,10 +816,10 @@ void waf_archive_close(struct waf_archive *arc)
 	if (!arc)
 		return;
 
-	if (arc->fp)
+	if (arc->io.close)
 	{
-		fclose(arc->fp);
-		arc->fp = NULL;
+		arc->io.close(arc->io.user);
+		arc->io.close = NULL;
 	}
 	
 	if (arc->infs)
@@ -220,127 +835,2229 @@ void waf_archive_close(struct waf_archive *arc)
 		arc->infs = NULL;
 	}
 
+	if (arc->indexbuf)
+	{
+		free(arc->indexbuf);
+		arc->indexbuf = NULL;
+	}
+	arc->index = NULL;
+
+	if (arc->dict)
+	{
+		free(arc->dict);
+		arc->dict = NULL;
+	}
+
+	waf_archive_record(arc, NULL);
+	waf_mutex_destroy(&arc->recordlock);
+
 	free(arc);
 }
 
-struct waf_file* waf_open(struct waf_archive *arc, const char *filename)
+/* load the chunk list of a file in a chunked archive */
+static int waf_load_chunks(struct waf_file *file)
 {
+	unsigned char pair[WAF_U64_SIZE + WAF_U32_SIZE];
+	waf_size_t pairsize = WAF_OFF_SIZE(file->arc) + WAF_U32_SIZE;
+	waf_size_t start = 0;
+	waf_size_t pos = file->inf.offset;
 	waf_size_t i;
-	waf_size_t hash;
 
-	assert(arc != NULL);
-	assert(filename != NULL);
+	if (waf_readsize(file->arc, &pos, &file->blocks) != 0 || file->blocks > file->inf.size)
+		return -1;
 
-	hash = waf_strhash(filename);
+	file->fast_offset = (waf_size_t*)malloc(sizeof(waf_size_t) * (file->blocks + 1));
+	file->chunk_start = (waf_size_t*)malloc(sizeof(waf_size_t) * (file->blocks + 1));
+	if (!file->fast_offset || !file->chunk_start)
+		return -1;
 
-	for (i = 0; i < arc->count; i++)
+	for (i = 0; i < file->blocks; i++)
 	{
-		if (arc->infs[i]->hash == hash && strcmp(arc->infs[i]->name, filename) == 0)
-		{
-			struct waf_file *fp = NULL;
-			struct waf_inf *inf = arc->infs[i];
-			waf_size_t size;
-
-			/* prepare waf_file struct */
-			fp = (struct waf_file*)malloc(sizeof(struct waf_file));
-			if (!fp)
-				goto __error;
-			memset(fp, 0, sizeof(struct waf_file));
-
-			fp->fp = arc->fp;
-			fp->cur = 0;
-			fp->cp = ~0;  /* should never have any block at this position */
-			fp->np = inf->offset;
-			fp->inf = inf;
-			fp->coff = 0;
-			fp->csize = 0;
-
-			/* prepare fast offset */
-			size = sizeof(waf_size_t) * ((inf->size + WAF_BUFF_SIZE - 1) / WAF_BUFF_SIZE);
-			fp->fast_offset = (waf_size_t*)malloc(size);
-			if (!fp->fast_offset)
-				goto __error;
-			memset(fp->fast_offset, 0, size);
-			fp->fast_offset[0] = inf->offset;
+		waf_size_t size;
 
-			goto __finish;
+		if (waf_pread(file->arc, pos, pair, pairsize) != 0)
+			return -1;
+		pos += pairsize;
 
-__error:
-			if (fp)
-			{
-				if (fp->fast_offset)
-					free(fp->fast_offset);
+		size = WAF_U32(&pair[WAF_OFF_SIZE(file->arc)]);
+		if (size == 0 || size > WAF_BUFF_SIZE)
+			return -1;
 
-				free(fp);
-				fp = NULL;
-			}
+		file->fast_offset[i] = WAF_OFF(file->arc, pair) + file->arc->base;
+		file->chunk_start[i] = start;
+		start += size;
+	}
 
-__finish:
+	if (start != file->inf.size)
+		return -1;
 
-			return fp;
-		}
-	}
+	file->fast_offset[i] = 0;
+	file->chunk_start[i] = start;
+
+	return 0;
+}
+
+/* read a front-coding length, 7 bits per byte */
+static int waf_varint(const struct waf_archive *arc, waf_size_t *pos, waf_size_t *value)
+{
+	int shift;
+
+	*value = 0;
+	for (shift = 0; shift < 32 && *pos < arc->namesize; shift += 7)
+	{
+		unsigned char c = arc->names[(*pos)++];
+
+		*value |= (waf_size_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/* decode the name at pos over the previous name in the buffer */
+static int waf_next_name(const struct waf_archive *arc, waf_size_t *pos, char *name)
+{
+	waf_size_t shared;
+	waf_size_t suffix;
+
+	if (waf_varint(arc, pos, &shared) != 0 || waf_varint(arc, pos, &suffix) != 0)
+		return -1;
+
+	if (shared > strlen(name) || suffix >= WAF_FILENAME_SIZE - shared || suffix > arc->namesize - *pos)
+		return -1;
+
+	memcpy(&name[shared], &arc->names[*pos], (size_t)suffix);
+	name[shared + suffix] = 0;
+	*pos += suffix;
+
+	return 0;
+}
+
+/* position of the restart point of a block of names */
+static waf_size_t waf_restart(const struct waf_archive *arc, waf_size_t block)
+{
+	return WAF_U32(&arc->restarts[block * WAF_U32_SIZE]);
+}
+
+/* decode the name of an entry, walking forward from the restart point before it */
+static int waf_entry_name(const struct waf_archive *arc, waf_size_t id, char *name)
+{
+	waf_size_t i = id - id % WAF_RESTART_INTERVAL;
+	waf_size_t pos = waf_restart(arc, id / WAF_RESTART_INTERVAL);
+
+	name[0] = 0;
+	for (; i <= id; i++)
+	{
+		if (waf_next_name(arc, &pos, name) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* get the data of a record */
+static void waf_data(const struct waf_archive *arc, waf_size_t ref, struct waf_inf *inf)
+{
+	const unsigned char *data = &arc->data[ref * WAF_DATA_SIZE];
+
+	inf->hash = 0;
+	inf->size = WAF_U64(data);
+	inf->offset = WAF_U64(&data[WAF_U64_SIZE]) + arc->base;
+	inf->extent = WAF_U64(&data[WAF_U64_SIZE * 2]);
+}
+
+/* get the info of an entry, names are decoded separately for packed indexes */
+static int waf_entry(struct waf_archive *arc, waf_size_t id, struct waf_inf *inf)
+{
+	waf_size_t ref;
+
+	if (id >= arc->count)
+		return -1;
+
+	if (!arc->index)
+	{
+		*inf = *arc->infs[id];
+		return 0;
+	}
+
+	ref = WAF_U32(&arc->refs[id * WAF_U32_SIZE]);
+	if (ref >= arc->ndata)
+		return -1;
+
+	inf->name[0] = 0;
+	waf_data(arc, ref, inf);
+
+	return 0;
+}
+
+/* find the base file of a delta, the name is left empty with a packed index */
+static int waf_find_base(struct waf_archive *arc, waf_size_t ref, struct waf_inf *inf)
+{
+	if (ref == 0 || !arc->index || ref > arc->ndata)
+		return -1;
+
+	inf->name[0] = 0;
+	waf_data(arc, ref - 1, inf);
+	return 0;
+}
+
+/* find an entry by name, returns 0 if found */
+static int waf_find_entry(struct waf_archive *arc, const char *filename, waf_size_t *id)
+{
+	waf_stats *stats = waf_stats_local();
+	waf_size_t i;
+	waf_size_t hash;
+
+	stats->lookups++;
+
+	if (arc->index)
+	{
+		char name[WAF_FILENAME_SIZE];
+		waf_size_t slot;
+
+		if (arc->count == 0)
+			return -1;
+
+		/* minimal perfect hash, the name can only be at one slot */
+		hash = waf_namehash(filename);
+		slot = WAF_U32(&arc->disp[(hash % arc->nbuckets) * WAF_U32_SIZE]);
+		slot = waf_mix(hash + slot * WAF_HASH_GOLDEN) % arc->count;
+		stats->probes++;
+
+		*id = WAF_U32(&arc->slots[slot * WAF_U32_SIZE]);
+		if (*id >= arc->count || waf_entry_name(arc, *id, name) != 0)
+			return -1;
+
+		return strcmp(name, filename) == 0 ? 0 : -1;
+	}
+
+	hash = waf_strhash(filename);
+
+	for (i = 0; i < arc->count; i++)
+	{
+		if (arc->infs[i]->hash == hash && strcmp(arc->infs[i]->name, filename) == 0)
+		{
+			stats->probes += i + 1;
+			*id = i;
+			return 0;
+		}
+	}
+
+	stats->probes += arc->count;
+	return -1;
+}
+
+/* open the file described by inf */
+static struct waf_file* waf_open_inf(struct waf_archive *arc, const struct waf_inf *inf)
+{
+	struct waf_file *fp = NULL;
+	waf_size_t size;
+
+	/* prepare waf_file struct */
+	fp = (struct waf_file*)malloc(sizeof(struct waf_file));
+	if (!fp)
+		goto __error;
+	memset(fp, 0, sizeof(struct waf_file));
+
+	fp->arc = arc;
+	fp->id = WAF_NO_ID;
+	fp->cur = 0;
+	fp->cp = ~0;  /* should never have any block at this position */
+	fp->np = inf->offset;
+	fp->nb = 0;
+	fp->inf = *inf;
+	fp->coff = 0;
+	fp->csize = 0;
+	fp->cbuf = fp->cdata;
+
+	if (arc->flags & WAF_FLAG_DELTA)
+	{
+		/* data starts with the base file, 0 if none */
+		if (waf_readoff(arc, &fp->np, &fp->base_ref) != 0)
+			goto __error;
+	}
+
+	if (arc->flags & WAF_FLAG_CHUNKS)
+	{
+		/* chunk offsets are listed up front */
+		if (waf_load_chunks(fp) != 0)
+			goto __error;
+	}
+	else
+	{
+		/* prepare fast offset, the extra slot is the end-of-file block */
+		fp->blocks = (inf->size + WAF_BUFF_SIZE - 1) / WAF_BUFF_SIZE;
+		size = sizeof(waf_size_t) * (fp->blocks + 1);
+		fp->fast_offset = (waf_size_t*)malloc(size);
+		if (!fp->fast_offset)
+			goto __error;
+		memset(fp->fast_offset, 0, size);
+		fp->fast_offset[0] = fp->np;
+	}
+
+	return fp;
+
+__error:
+	waf_close(fp);
+	return NULL;
+}
+
+struct waf_file* waf_open(struct waf_archive *arc, const char *filename)
+{
+	waf_stats *stats = waf_stats_local();
+	waf_size_t start = waf_clock();
+	struct waf_file *file = NULL;
+	struct waf_inf inf;
+	waf_size_t id = WAF_NO_ID;
+
+	assert(arc != NULL);
+	assert(filename != NULL);
+
+	WAF_PROBE1(open_start, filename);
+
+	if (waf_find_entry(arc, filename, &id) == 0 && waf_entry(arc, id, &inf) == 0)
+		file = waf_open_inf(arc, &inf);
+	if (file)
+		file->id = id;
+
+	WAF_PROBE2(open_end, id, file);
+
+	if (file)
+		stats->opens++;
+	waf_stats_time(stats, WAF_OP_OPEN, start);
+	WAF_TRACE_SPAN(WAF_EVENT_OPEN, start, id, file ? file->inf.size : 0);
+
+	return file;
+}
+
+/* check the name of an entry */
+static int waf_entry_is(struct waf_archive *arc, waf_size_t id, const char *filename)
+{
+	char name[WAF_FILENAME_SIZE];
+
+	if (!arc->index)
+		return id < arc->count && strcmp(arc->infs[id]->name, filename) == 0;
+
+	return waf_entry_name(arc, id, name) == 0 && strcmp(name, filename) == 0;
+}
+
+struct waf_mount* waf_mount_create(void)
+{
+	struct waf_mount *mount;
+
+	mount = (struct waf_mount*)malloc(sizeof(struct waf_mount));
+	if (mount)
+		mount->table = NULL;
+
+	return mount;
+}
+
+static void waf_mount_free_table(struct waf_mount_table *table)
+{
+	if (table->slots)
+		free(table->slots);
+	if (table->bloom)
+		free(table->bloom);
+	free(table);
+}
+
+void waf_mount_close(struct waf_mount *mount)
+{
+	struct waf_mount_table *table;
+
+	if (!mount)
+		return;
+
+	while (mount->table)
+	{
+		table = mount->table;
+		mount->table = table->prev;
+		waf_mount_free_table(table);
+	}
+
+	free(mount);
+}
+
+/* bloom filter probes, double hashing over one mixed hash */
+#define WAF_BLOOM_PROBES 4
+#define WAF_BLOOM_BIT(table,mixed,k) (((mixed) + (k) * (((mixed) >> 32) | 1)) & (table)->bloommask)
+
+static void waf_mount_insert(struct waf_mount_table *table, struct waf_archive *arc, waf_size_t id, waf_size_t hash, const char *filename)
+{
+	waf_size_t i = hash & table->mask;
+	waf_size_t mixed = waf_mix(hash);
+	int k;
+
+	for (k = 0; k < WAF_BLOOM_PROBES; k++)
+	{
+		waf_size_t bit = WAF_BLOOM_BIT(table, mixed, k);
+		table->bloom[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+	}
+
+	/* a name already in the table is shadowed by the newer archive, names known to be new have no filename */
+	while (table->slots[i].arc)
+	{
+		if (filename && table->slots[i].hash == hash && waf_entry_is(table->slots[i].arc, table->slots[i].id, filename))
+			break;
+		i = (i + 1) & table->mask;
+	}
+
+	if (!table->slots[i].arc)
+		table->entries++;
+
+	table->slots[i].hash = hash;
+	table->slots[i].arc = arc;
+	table->slots[i].id = id;
+}
+
+int waf_mount_add(struct waf_mount *mount, struct waf_archive *arc)
+{
+	struct waf_mount_table *old;
+	struct waf_mount_table *table;
+	waf_size_t size = 16;
+	waf_size_t bits = 64;
+	waf_size_t need;
+	waf_size_t i;
+	waf_iter it;
+	int result;
+
+	assert(mount != NULL);
+	assert(arc != NULL);
+
+	old = mount->table;
+	need = (old ? old->entries : 0) + arc->count;
+
+	/* at most half full keeps probe chains short */
+	while (size < need * 2)
+		size <<= 1;
+	while (bits < need * WAF_MOUNT_BLOOM_BITS)
+		bits <<= 1;
+
+	table = (struct waf_mount_table*)malloc(sizeof(struct waf_mount_table));
+	if (!table)
+		return -1;
+
+	table->mask = size - 1;
+	table->bloommask = bits - 1;
+	table->entries = 0;
+	table->prev = old;
+	table->slots = (struct waf_mount_slot*)calloc((size_t)size, sizeof(struct waf_mount_slot));
+	table->bloom = (unsigned char*)calloc((size_t)(bits / 8), 1);
+	if (!table->slots || !table->bloom)
+		goto __error;
+
+	/* names of the old table are unique already */
+	for (i = 0; old && i <= old->mask; i++)
+	{
+		if (old->slots[i].arc)
+			waf_mount_insert(table, old->slots[i].arc, old->slots[i].id, old->slots[i].hash, NULL);
+	}
+
+	if (waf_list(arc, "", &it) != 0)
+		goto __error;
+	while ((result = waf_next(&it)) == 0)
+		waf_mount_insert(table, arc, it.id, waf_namehash(it.name), old ? it.name : NULL);
+	if (result < 0)
+		goto __error;
+
+	/* readers switch to the new table, the old one stays valid for readers still using it */
+	WAF_STORE_RELEASE(mount->table, table);
+
+	return 0;
+
+__error:
+	table->prev = NULL;
+	waf_mount_free_table(table);
+
+	return -1;
+}
+
+waf_size_t waf_mount_find(struct waf_mount *mount, const char *filename, struct waf_archive **arc)
+{
+	waf_stats *stats = waf_stats_local();
+	struct waf_mount_table *table;
+	waf_size_t hash;
+	waf_size_t mixed;
+	waf_size_t i;
+	int k;
+
+	assert(mount != NULL);
+	assert(filename != NULL);
+
+	table = WAF_LOAD_ACQUIRE(mount->table);
+	if (!table)
+		return WAF_NO_ID;
+
+	stats->lookups++;
+
+	hash = waf_namehash(filename);
+	mixed = waf_mix(hash);
+
+	/* most misses stop at the bloom filter */
+	for (k = 0; k < WAF_BLOOM_PROBES; k++)
+	{
+		waf_size_t bit = WAF_BLOOM_BIT(table, mixed, k);
+		if (!(table->bloom[bit >> 3] & (1 << (bit & 7))))
+			return WAF_NO_ID;
+	}
+
+	for (i = hash & table->mask; table->slots[i].arc; i = (i + 1) & table->mask)
+	{
+		stats->probes++;
+		if (table->slots[i].hash == hash && waf_entry_is(table->slots[i].arc, table->slots[i].id, filename))
+		{
+			if (arc)
+				*arc = table->slots[i].arc;
+			return table->slots[i].id;
+		}
+	}
+
+	return WAF_NO_ID;
+}
+
+struct waf_file* waf_mount_open(struct waf_mount *mount, const char *filename)
+{
+	struct waf_archive *arc;
+	waf_size_t id;
+
+	id = waf_mount_find(mount, filename, &arc);
+	if (id == WAF_NO_ID)
+		return NULL;
+
+	return waf_open_id(arc, id);
+}
+
+static waf_size_t waf_cache_hash(unsigned long serial, waf_size_t offset)
+{
+	return waf_mix(offset ^ ((waf_size_t)serial * WAF_HASH_GOLDEN));
+}
+
+static void waf_cache_free_shard(struct waf_cache_shard *shard)
+{
+	struct waf_cache_cold *cold;
+	unsigned long i;
+
+	waf_mutex_destroy(&shard->lock);
+
+	if (shard->blocks)
+	{
+		for (i = 0; i < shard->nblocks; i++)
+		{
+			if (shard->blocks[i].data)
+				free(shard->blocks[i].data);
+		}
+		free(shard->blocks);
+	}
+
+	if (shard->cold)
+	{
+		for (i = 0; i <= shard->coldmask; i++)
+		{
+			while (shard->cold[i])
+			{
+				cold = shard->cold[i];
+				shard->cold[i] = cold->next;
+				free(cold);
+			}
+		}
+		free(shard->cold);
+	}
+
+	if (shard->hints)
+		free((void*)shard->hints);
+	if (shard->ghosts)
+		free(shard->ghosts);
+	free(shard);
+}
+
+static struct waf_cache* waf_cache_alloc(waf_size_t capacity, int tiered)
+{
+	struct waf_cache *cache;
+	struct waf_cache_shard *shard;
+	waf_size_t nblocks;
+	unsigned long hints;
+	unsigned long i;
+
+	/* at least two blocks a shard, so one can be evicted while the other is pinned */
+	nblocks = capacity / WAF_BUFF_SIZE / WAF_CACHE_SHARDS;
+	if (nblocks < 2)
+		nblocks = 2;
+	if (nblocks > WAF_CACHE_MAX_BLOCKS)
+		nblocks = WAF_CACHE_MAX_BLOCKS;
+
+	for (hints = 1; hints < nblocks * 2; hints <<= 1)
+		;
+
+	cache = (struct waf_cache*)malloc(sizeof(struct waf_cache));
+	if (!cache)
+		return NULL;
+	memset(cache, 0, sizeof(struct waf_cache));
+	cache->tiered = tiered;
+
+	for (i = 0; i < WAF_CACHE_SHARDS; i++)
+	{
+		shard = (struct waf_cache_shard*)malloc(sizeof(struct waf_cache_shard));
+		if (!shard)
+			goto __error;
+		memset(shard, 0, sizeof(struct waf_cache_shard));
+		waf_mutex_init(&shard->lock);
+		cache->shards[i] = shard;
+
+		shard->nblocks = (unsigned long)nblocks;
+		shard->hintmask = hints - 1;
+		shard->budget = nblocks * WAF_BUFF_SIZE;
+		shard->hottarget = tiered ? shard->budget / 2 : shard->budget;
+
+		shard->blocks = (struct waf_cache_block*)malloc(sizeof(struct waf_cache_block) * shard->nblocks);
+		shard->hints = (volatile unsigned long*)malloc(sizeof(unsigned long) * hints);
+		if (!shard->blocks || !shard->hints)
+			goto __error;
+		memset(shard->blocks, 0, sizeof(struct waf_cache_block) * shard->nblocks);
+		memset((void*)shard->hints, 0, sizeof(unsigned long) * hints);
+
+		if (tiered)
+		{
+			/* compressed blocks are smaller, there are more of them to find */
+			shard->coldmask = hints * 2 - 1;
+			shard->cold = (struct waf_cache_cold**)malloc(sizeof(struct waf_cache_cold*) * hints * 2);
+			shard->ghosts = (waf_size_t*)malloc(sizeof(waf_size_t) * hints * 2);
+			if (!shard->cold || !shard->ghosts)
+				goto __error;
+			memset(shard->cold, 0, sizeof(struct waf_cache_cold*) * hints * 2);
+			memset(shard->ghosts, 0, sizeof(waf_size_t) * hints * 2);
+		}
+	}
+
+	return cache;
+
+__error:
+	waf_cache_destroy(cache);
+	return NULL;
+}
+
+struct waf_cache* waf_cache_create(waf_size_t capacity)
+{
+	return waf_cache_alloc(capacity, 0);
+}
+
+struct waf_cache* waf_cache_create_tiered(waf_size_t capacity)
+{
+	return waf_cache_alloc(capacity, 1);
+}
+
+void waf_cache_destroy(struct waf_cache *cache)
+{
+	unsigned long i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < WAF_CACHE_SHARDS; i++)
+	{
+		if (cache->shards[i])
+			waf_cache_free_shard(cache->shards[i]);
+	}
+
+	if (cache->shm)
+	{
+#ifndef _WIN32
+		munmap(cache->shm->base, (size_t)cache->shm->mapsize);
+#endif
+		free(cache->shm);
+	}
+
+	if (cache->disk)
+	{
+		waf_mutex_destroy(&cache->disk->lock);
+		free(cache->disk->dir);
+		free(cache->disk);
+	}
+
+	free(cache);
+}
+
+/*
+identity of the archive contents, the same in every process: a hash of the
+digest the builder stores, 0 for archives without one. the index alone is
+no identity, an edit that keeps every compressed size would not change it
+*/
+static waf_size_t waf_archive_ident(struct waf_archive *arc)
+{
+	waf_size_t hash;
+
+	if (!(arc->flags & WAF_FLAG_DIGEST))
+		return 0;
+
+	hash = waf_datahash(WAF_CONST64(0xcbf29ce4, 0x84222325), arc->digest, WAF_DIGEST_SIZE);
+
+	return hash ? hash : 1;  /* 0 marks empty slots */
+}
+
+int waf_archive_set_cache(struct waf_archive *arc, struct waf_cache *cache)
+{
+	assert(arc != NULL);
+
+	if (cache && (cache->shm || cache->disk))
+	{
+		/* blocks outside the process must never be taken for another build's */
+		if (arc->ident == 0)
+			arc->ident = waf_archive_ident(arc);
+		if (arc->ident == 0)
+			return -1;
+	}
+
+	arc->cache = cache;
+	return 0;
+}
+
+#ifndef _WIN32
+
+/* wait a millisecond for another process */
+static void waf_shm_pause(void)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000;
+	nanosleep(&ts, NULL);
+}
+
+/* map a cache segment, creating it if it does not exist yet, stale is set if its creator never finished it */
+static struct waf_shm* waf_shm_attach(const char *name, waf_size_t capacity, int *stale)
+{
+	struct waf_shm *shm;
+	struct waf_shm_header *header;
+	struct stat st;
+	waf_size_t nsets;
+	waf_size_t slotsize;
+	waf_size_t size;
+	void *base;
+	int created = 1;
+	int tries;
+	int fd;
+
+	nsets = capacity / WAF_BUFF_SIZE / WAF_CACHE_PROBES;
+	if (nsets == 0)
+		nsets = 1;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		fd = shm_open(name, O_RDWR, 0600);
+		created = 0;
+	}
+	if (fd < 0)
+		return NULL;
+
+	if (created)
+	{
+		slotsize = (sizeof(struct waf_shm_header) + sizeof(struct waf_shm_slot) * nsets * WAF_CACHE_PROBES + 4095) & ~(waf_size_t)4095;
+		size = slotsize + nsets * WAF_CACHE_PROBES * WAF_BUFF_SIZE;
+
+		/* a new segment reads as zeros, every slot empty */
+		if (ftruncate(fd, (off_t)size) != 0)
+		{
+			close(fd);
+			shm_unlink(name);
+			return NULL;
+		}
+	}
+	else
+	{
+		/* the creator may still be sizing it */
+		for (tries = 0; ; tries++)
+		{
+			if (fstat(fd, &st) != 0 || tries >= 1000)
+			{
+				*stale = tries >= 1000;
+				close(fd);
+				return NULL;
+			}
+			if (st.st_size > 0)
+				break;
+			waf_shm_pause();
+		}
+		size = (waf_size_t)st.st_size;
+	}
+
+	base = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	header = (struct waf_shm_header*)base;
+	if (created)
+	{
+		header->nsets = nsets;
+		header->blocksize = WAF_BUFF_SIZE;
+		WAF_STORE_RELEASE(header->magic, WAF_SHM_MAGIC);
+	}
+	else
+	{
+		for (tries = 0; WAF_LOAD_ACQUIRE(header->magic) != WAF_SHM_MAGIC && tries < 1000; tries++)
+			waf_shm_pause();
+		*stale = WAF_LOAD_ACQUIRE(header->magic) == 0;
+	}
+
+	/* the segment decides the geometry, whatever capacity this process asked for */
+	nsets = header->nsets;
+	slotsize = (sizeof(struct waf_shm_header) + sizeof(struct waf_shm_slot) * nsets * WAF_CACHE_PROBES + 4095) & ~(waf_size_t)4095;
+	if (WAF_LOAD_ACQUIRE(header->magic) != WAF_SHM_MAGIC || header->blocksize != WAF_BUFF_SIZE || nsets == 0 ||
+		slotsize + nsets * WAF_CACHE_PROBES * WAF_BUFF_SIZE > size)
+	{
+		munmap(base, (size_t)size);
+		return NULL;
+	}
+
+	shm = (struct waf_shm*)malloc(sizeof(struct waf_shm));
+	if (!shm)
+	{
+		munmap(base, (size_t)size);
+		return NULL;
+	}
+
+	shm->base = base;
+	shm->mapsize = size;
+	shm->nsets = nsets;
+	shm->slots = (struct waf_shm_slot*)((unsigned char*)base + sizeof(struct waf_shm_header));
+	shm->data = (unsigned char*)base + slotsize;
+
+	return shm;
+}
+
+static struct waf_shm* waf_shm_map(const char *name, waf_size_t capacity)
+{
+	struct waf_shm *shm;
+	int stale = 0;
+
+	shm = waf_shm_attach(name, capacity, &stale);
+
+	/* a creator that died between creating the segment and setting it up would lock everyone out for good */
+	if (!shm && stale)
+	{
+		shm_unlink(name);
+		stale = 0;
+		shm = waf_shm_attach(name, capacity, &stale);
+	}
+
+	return shm;
+}
+
+/* the writer holding a slot is gone */
+static int waf_shm_orphaned(waf_size_t lock)
+{
+	pid_t pid = (pid_t)(lock >> 32);
+
+	return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/* copy a block out of the segment, fails if it is missing or was being replaced */
+static int waf_shm_get(struct waf_shm *shm, waf_size_t ident, waf_size_t offset, unsigned char *out, waf_size_t *size, waf_size_t *payload)
+{
+	waf_size_t h = waf_mix(offset ^ ident);
+	waf_size_t first = (h % shm->nsets) * WAF_CACHE_PROBES;
+	struct waf_shm_slot *slot;
+	waf_size_t lock;
+	waf_size_t i;
+
+	for (i = first; i < first + WAF_CACHE_PROBES; i++)
+	{
+		slot = &shm->slots[i];
+
+		lock = WAF_LOAD_ACQUIRE(slot->lock);
+		if ((lock & 1) || slot->ident != ident || slot->offset != offset || slot->size > WAF_BUFF_SIZE)
+			continue;
+
+		*size = slot->size;
+		*payload = slot->payload;
+		memcpy(out, &shm->data[i * WAF_BUFF_SIZE], (size_t)*size);
+
+		WAF_FENCE();
+		if (WAF_LOAD_ACQUIRE(slot->lock) != lock)
+			return 0;  /* replaced while copying */
+
+		if (!WAF_LOAD_ACQUIRE(slot->used))
+			WAF_STORE_RELEASE(slot->used, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* claim a slot of the block's set with the clock and fill it, skipped when another process gets there first */
+static void waf_shm_put(struct waf_shm *shm, waf_size_t ident, waf_size_t offset, const unsigned char *data, waf_size_t size, waf_size_t payload)
+{
+	waf_size_t h = waf_mix(offset ^ ident);
+	waf_size_t first = (h % shm->nsets) * WAF_CACHE_PROBES;
+	struct waf_shm_slot *slot;
+	struct waf_shm_slot *victim = NULL;
+	waf_size_t lock = 0;
+	waf_size_t seq;
+	waf_size_t i;
+	waf_size_t pass;
+
+	/* empty slots first, then unused ones, then slots of crashed writers */
+	for (pass = 0; pass < 3 && !victim; pass++)
+	{
+		for (i = first; i < first + WAF_CACHE_PROBES; i++)
+		{
+			slot = &shm->slots[i];
+			lock = WAF_LOAD_ACQUIRE(slot->lock);
+
+			if (lock & 1)
+			{
+				if (pass == 2 && waf_shm_orphaned(lock))
+				{
+					victim = slot;
+					break;
+				}
+				continue;
+			}
+
+			if (slot->ident == ident && slot->offset == offset)
+				return;  /* already there */
+
+			if (pass == 0 && slot->ident == 0)
+			{
+				victim = slot;
+				break;
+			}
+
+			if (pass == 1)
+			{
+				if (!WAF_LOAD_ACQUIRE(slot->used))
+				{
+					victim = slot;
+					break;
+				}
+				WAF_STORE_RELEASE(slot->used, 0);
+			}
+		}
+	}
+
+	if (!victim)
+		return;
+
+	/* odd sequence with this process as the writer */
+	seq = ((lock & 0xffffffffUL) + 1) | 1;
+	if (!WAF_CAS(victim->lock, lock, ((waf_size_t)getpid() << 32) | (seq & 0xffffffffUL)))
+		return;
+
+	if (victim->ident)
+		waf_stats_local()->cache_evictions++;
+
+	i = (waf_size_t)(victim - shm->slots);
+	victim->ident = ident;
+	victim->offset = offset;
+	victim->size = size;
+	victim->payload = payload;
+	memcpy(&shm->data[i * WAF_BUFF_SIZE], data, (size_t)size);
+
+	WAF_STORE_RELEASE(victim->used, 1);
+	WAF_STORE_RELEASE(victim->lock, (seq + 1) & 0xffffffffUL);
+}
+
+static void waf_hex(char *out, waf_size_t value)
+{
+	int i;
+
+	for (i = 15; i >= 0; i--, value >>= 4)
+		out[i] = "0123456789abcdef"[value & 15];
+	out[16] = 0;
+}
+
+/* block file name, the archive identity then the block offset */
+static void waf_disk_name(char *name, waf_size_t ident, waf_size_t offset)
+{
+	waf_hex(name, ident);
+	name[16] = '-';
+	waf_hex(&name[17], offset);
+	strcpy(&name[33], ".wblk");
+}
+
+static int waf_disk_ours(const char *name)
+{
+	size_t len = strlen(name);
+
+	return (len > 5 && strcmp(&name[len - 5], ".wblk") == 0) || (len > 4 && strcmp(&name[len - 4], ".tmp") == 0);
+}
+
+/* full path of a file in the cache directory */
+static char* waf_disk_path(struct waf_disk *disk, const char *name)
+{
+	char *path = (char*)malloc(strlen(disk->dir) + strlen(name) + 2);
+
+	if (path)
+		sprintf(path, "%s/%s", disk->dir, name);
+
+	return path;
+}
+
+struct waf_disk_entry
+{
+	time_t mtime;
+	waf_size_t size;
+	char name[WAF_DISK_NAME_SIZE + 32];
+};
+
+static int waf_disk_older(const void *a, const void *b)
+{
+	time_t ta = ((const struct waf_disk_entry*)a)->mtime;
+	time_t tb = ((const struct waf_disk_entry*)b)->mtime;
+
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+/*
+measure the directory, and delete the least recently used blocks until it
+fits in target bytes. hits refresh the time of a block file, so the oldest
+go first. called with the lock held
+*/
+static void waf_disk_trim(struct waf_disk *disk, waf_size_t target)
+{
+	struct waf_disk_entry *entries = NULL;
+	struct waf_disk_entry *grown;
+	struct dirent *de;
+	struct stat st;
+	size_t count = 0;
+	size_t cap = 0;
+	size_t i;
+	waf_size_t total = 0;
+	char *path;
+	time_t now = time(NULL);
+	DIR *dir;
+
+	dir = opendir(disk->dir);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (!waf_disk_ours(de->d_name) || strlen(de->d_name) >= sizeof(entries->name))
+			continue;
+
+		path = waf_disk_path(disk, de->d_name);
+		if (!path)
+			break;
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			free(path);
+			continue;
+		}
+
+		/* a temp file may be another process's block being written, only old ones are left over */
+		if (strcmp(&de->d_name[strlen(de->d_name) - 4], ".tmp") == 0)
+		{
+			if (now - st.st_mtime > WAF_DISK_TMP_AGE)
+				unlink(path);
+			free(path);
+			continue;
+		}
+		free(path);
+
+		if (count == cap)
+		{
+			cap = cap ? cap * 2 : 256;
+			grown = (struct waf_disk_entry*)realloc(entries, sizeof(struct waf_disk_entry) * cap);
+			if (!grown)
+				break;
+			entries = grown;
+		}
+
+		entries[count].mtime = st.st_mtime;
+		entries[count].size = (waf_size_t)st.st_size;
+		strcpy(entries[count].name, de->d_name);
+		total += entries[count].size;
+		count++;
+	}
+	closedir(dir);
+
+	if (entries && total > target)
+	{
+		qsort(entries, count, sizeof(struct waf_disk_entry), waf_disk_older);
+
+		for (i = 0; i < count && total > target; i++)
+		{
+			path = waf_disk_path(disk, entries[i].name);
+			if (!path)
+				break;
+			if (unlink(path) == 0)
+			{
+				total -= entries[i].size;
+				waf_stats_local()->cache_evictions++;
+			}
+			else if (errno == ENOENT)
+				total -= entries[i].size;
+			free(path);
+		}
+	}
+
+	free(entries);
+	disk->bytes = total;
+}
+
+/* map a block file, the file reads it in place until its next block */
+static int waf_disk_get(struct waf_disk *disk, struct waf_file *file, waf_size_t *payload)
+{
+	char name[WAF_DISK_NAME_SIZE];
+	unsigned char *map;
+	struct stat st;
+	char *path;
+	waf_size_t size;
+	int fd;
+
+	waf_disk_name(name, file->arc->ident, file->np);
+	path = waf_disk_path(disk, name);
+	if (!path)
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < WAF_DISK_HEADER_SIZE)
+		goto __miss;
+
+	map = (unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == (unsigned char*)MAP_FAILED)
+		goto __miss;
+
+	size = WAF_U32(&map[WAF_U32_SIZE]);
+	if (WAF_U32(map) != WAF_DISK_MAGIC || size > WAF_BUFF_SIZE || (waf_size_t)st.st_size != WAF_DISK_HEADER_SIZE + size)
+	{
+		munmap(map, (size_t)st.st_size);
+		goto __miss;
+	}
+
+	/* recently used, refreshed at most once a minute */
+	if (st.st_mtime + WAF_DISK_TOUCH < time(NULL))
+		utime(path, NULL);
+
+	close(fd);
+	free(path);
+
+	file->mapped = map;
+	file->mappedsize = (waf_size_t)st.st_size;
+	file->cbuf = &map[WAF_DISK_HEADER_SIZE];
+	file->csize = size;
+	*payload = WAF_U32(&map[WAF_U32_SIZE * 2]);
+
+	return 1;
+
+__miss:
+	if (fd >= 0)
+		close(fd);
+	free(path);
+	return 0;
+}
+
+/* write a block file under a temporary name, then rename it so readers never see a partial one */
+static void waf_disk_put(struct waf_disk *disk, waf_size_t ident, waf_size_t offset, const unsigned char *data, waf_size_t size, waf_size_t payload)
+{
+	static volatile unsigned long unique = 0;
+	char name[WAF_DISK_NAME_SIZE + 32];
+	unsigned char header[WAF_DISK_HEADER_SIZE];
+	char *path = NULL;
+	char *tmp = NULL;
+	int written = 0;
+	int fd;
+
+	waf_disk_name(name, ident, offset);
+	path = waf_disk_path(disk, name);
+
+	/* unique to this process and thread */
+	waf_hex(&name[33], ((waf_size_t)getpid() << 32) | WAF_ATOMIC_ADD(unique, 1));
+	strcpy(&name[49], ".tmp");
+	tmp = waf_disk_path(disk, name);
+	if (!path || !tmp)
+		goto __finish;
+
+	header[0] = (unsigned char)(WAF_DISK_MAGIC & 0xff);
+	header[1] = (unsigned char)((WAF_DISK_MAGIC >> 8) & 0xff);
+	header[2] = (unsigned char)((WAF_DISK_MAGIC >> 16) & 0xff);
+	header[3] = (unsigned char)((WAF_DISK_MAGIC >> 24) & 0xff);
+	header[4] = (unsigned char)(size & 0xff);
+	header[5] = (unsigned char)((size >> 8) & 0xff);
+	header[6] = (unsigned char)((size >> 16) & 0xff);
+	header[7] = (unsigned char)((size >> 24) & 0xff);
+	header[8] = (unsigned char)(payload & 0xff);
+	header[9] = (unsigned char)((payload >> 8) & 0xff);
+	header[10] = (unsigned char)((payload >> 16) & 0xff);
+	header[11] = (unsigned char)((payload >> 24) & 0xff);
+	memset(&header[12], 0, WAF_U32_SIZE);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto __finish;
+
+	written = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+		write(fd, data, (size_t)size) == (ssize_t)size;
+	close(fd);
+
+	if (!written || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		goto __finish;
+	}
+
+	waf_mutex_lock(&disk->lock);
+	disk->bytes += WAF_DISK_HEADER_SIZE + size;
+	if (disk->bytes > disk->capacity)
+		waf_disk_trim(disk, disk->capacity - disk->capacity / WAF_DISK_TRIM);
+	waf_mutex_unlock(&disk->lock);
+
+__finish:
+	free(path);
+	free(tmp);
+}
+
+#endif  /* _WIN32 */
+
+struct waf_cache* waf_cache_open_shared(const char *name, waf_size_t capacity)
+{
+#ifndef _WIN32
+	struct waf_cache *cache;
+
+	assert(name != NULL);
+
+	cache = (struct waf_cache*)malloc(sizeof(struct waf_cache));
+	if (!cache)
+		return NULL;
+	memset(cache, 0, sizeof(struct waf_cache));
+
+	cache->shm = waf_shm_map(name, capacity);
+	if (!cache->shm)
+	{
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+#else
+	(void)name;
+	(void)capacity;
+	return NULL;  /* posix shared memory only */
+#endif
+}
+
+int waf_cache_unlink_shared(const char *name)
+{
+#ifndef _WIN32
+	return shm_unlink(name) == 0 ? 0 : -1;
+#else
+	(void)name;
+	return -1;
+#endif
+}
+
+struct waf_cache* waf_cache_open_dir(const char *dir, waf_size_t capacity)
+{
+#ifndef _WIN32
+	struct waf_cache *cache;
+	struct waf_disk *disk;
+
+	assert(dir != NULL);
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return NULL;
+
+	cache = (struct waf_cache*)malloc(sizeof(struct waf_cache));
+	disk = (struct waf_disk*)malloc(sizeof(struct waf_disk));
+	if (!cache || !disk)
+		goto __error;
+	memset(cache, 0, sizeof(struct waf_cache));
+	memset(disk, 0, sizeof(struct waf_disk));
+
+	disk->dir = (char*)malloc(strlen(dir) + 1);
+	if (!disk->dir)
+		goto __error;
+	strcpy(disk->dir, dir);
+
+	waf_mutex_init(&disk->lock);
+	disk->capacity = capacity;
+	cache->disk = disk;
+
+	/* measure what earlier runs left, trimming it if the cap went down */
+	waf_disk_trim(disk, capacity);
+
+	return cache;
+
+__error:
+	if (disk)
+		free(disk);
+	if (cache)
+		free(cache);
+	return NULL;
+#else
+	(void)dir;
+	(void)capacity;
+	return NULL;  /* posix only */
+#endif
+}
+
+static struct waf_cache_shard* waf_cache_shard(struct waf_cache *cache, waf_size_t h)
+{
+	return cache->shards[(unsigned long)h & (WAF_CACHE_SHARDS - 1)];
+}
+
+/* keep a block from being evicted, fails while it is busy */
+static int waf_cache_pin(struct waf_cache_block *block)
+{
+	unsigned long state;
+
+	for (;;)
+	{
+		state = WAF_LOAD_ACQUIRE(block->state);
+		if (state & WAF_CACHE_BUSY)
+			return 0;
+		if (WAF_CAS(block->state, state, state + 1))
+			return 1;
+	}
+}
+
+static void waf_cache_unpin(struct waf_cache_block *block)
+{
+	WAF_ATOMIC_ADD(block->state, (unsigned long)-1);
+}
+
+/* find and pin a block, without locking */
+static struct waf_cache_block* waf_cache_lookup(struct waf_cache *cache, unsigned long serial, waf_size_t offset)
+{
+	waf_size_t h = waf_cache_hash(serial, offset);
+	struct waf_cache_shard *shard = waf_cache_shard(cache, h);
+	unsigned long tag = WAF_CACHE_TAG(h);
+	unsigned long slot = (unsigned long)(h >> 8);
+	unsigned long entry;
+	struct waf_cache_block *block;
+	unsigned long i;
+
+	for (i = 0; i < WAF_CACHE_PROBES; i++)
+	{
+		entry = WAF_LOAD_ACQUIRE(shard->hints[(slot + i) & shard->hintmask]);
+		if (entry == 0 || (entry >> 16) != tag)
+			continue;
+
+		/* the hint may be stale, the key is checked once the block cannot change */
+		block = &shard->blocks[(entry & 0xffff) - 1];
+		if (!waf_cache_pin(block))
+			continue;
+
+		if (block->serial == serial && block->offset == offset)
+		{
+			if (!WAF_LOAD_ACQUIRE(block->used))
+				WAF_STORE_RELEASE(block->used, 1);
+			return block;
+		}
+
+		waf_cache_unpin(block);
+	}
+
+	return NULL;
+}
+
+/*
+claim an unpinned block with the clock, called with the lock held.
+empty blocks are only taken while the hot tier is below its target
+*/
+static struct waf_cache_block* waf_cache_claim(struct waf_cache_shard *shard, int grow)
+{
+	struct waf_cache_block *b;
+	unsigned long free_state;
+	unsigned long i;
+
+	for (i = 0; i < shard->nblocks * 2; i++)
+	{
+		b = &shard->blocks[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->nblocks;
+
+		if (WAF_LOAD_ACQUIRE(b->state) != 0 || (!b->data && !grow))
+			continue;
+
+		if (WAF_LOAD_ACQUIRE(b->used))
+		{
+			WAF_STORE_RELEASE(b->used, 0);
+			continue;
+		}
+
+		free_state = 0;
+		if (WAF_CAS(b->state, free_state, WAF_CACHE_BUSY))
+		{
+			/* drop its hint, unless another block took the slot */
+			if (b->slot <= shard->hintmask && (shard->hints[b->slot] & 0xffff) == (unsigned long)(b - shard->blocks) + 1)
+				WAF_STORE_RELEASE(shard->hints[b->slot], 0);
+			b->slot = shard->hintmask + 1;  /* none */
+			return b;
+		}
+	}
+
+	return NULL;
+}
+
+/* give hot memory back once the target has moved to the cold tier, called with the lock held */
+static void waf_cache_shrink(struct waf_cache_shard *shard)
+{
+	struct waf_cache_block *b;
+
+	while (shard->hotbytes > shard->hottarget)
+	{
+		b = waf_cache_claim(shard, 0);
+		if (!b)
+			break;
+
+		free(b->data);
+		b->data = NULL;
+		b->serial = 0;  /* serials start at 1, never found */
+		shard->hotbytes -= WAF_BUFF_SIZE;
+		WAF_STORE_RELEASE(b->state, 0);
+	}
+}
+
+/* copy a decompressed block into the cache, skipped when every block is in use */
+static void waf_cache_insert(struct waf_cache *cache, unsigned long serial, waf_size_t offset,
+	const unsigned char *data, waf_size_t size, waf_size_t payload)
+{
+	waf_size_t h = waf_cache_hash(serial, offset);
+	struct waf_cache_shard *shard = waf_cache_shard(cache, h);
+	unsigned long tag = WAF_CACHE_TAG(h);
+	unsigned long slot = (unsigned long)(h >> 8);
+	struct waf_cache_block *block;
+	unsigned long i;
+
+	waf_mutex_lock(&shard->lock);
+
+	/* clock: skip pinned blocks, give recently used ones a second chance */
+	block = waf_cache_claim(shard, shard->hotbytes + WAF_BUFF_SIZE <= shard->hottarget);
+	if (!block)
+	{
+		waf_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	if (!block->data)
+	{
+		block->data = (unsigned char*)malloc(WAF_BUFF_SIZE);
+		if (!block->data)
+		{
+			WAF_STORE_RELEASE(block->state, 0);
+			waf_mutex_unlock(&shard->lock);
+			return;
+		}
+		shard->hotbytes += WAF_BUFF_SIZE;
+	}
+	else
+		waf_stats_local()->cache_evictions++;
+
+	/* an empty slot if the probes have one, otherwise the first one loses its hint */
+	block->slot = slot & shard->hintmask;
+	for (i = 0; i < WAF_CACHE_PROBES; i++)
+	{
+		if (shard->hints[(slot + i) & shard->hintmask] == 0)
+		{
+			block->slot = (slot + i) & shard->hintmask;
+			break;
+		}
+	}
+
+	/* lookups skip the block until it is filled */
+	WAF_STORE_RELEASE(shard->hints[block->slot], WAF_CACHE_ENTRY(tag, (unsigned long)(block - shard->blocks)));
+
+	waf_cache_shrink(shard);
+
+	waf_mutex_unlock(&shard->lock);
+
+	block->serial = serial;
+	block->offset = offset;
+	block->size = size;
+	block->payload = payload;
+	memcpy(block->data, data, (size_t)size);
+	WAF_STORE_RELEASE(block->used, 1);
+	WAF_STORE_RELEASE(block->state, 0);
+}
+
+/* move the hot target by a block, keeping an eighth of the budget for each tier */
+static void waf_cache_adapt(struct waf_cache_shard *shard, int grow)
+{
+	waf_size_t low = shard->budget / 8;
+	waf_size_t high = shard->budget - shard->budget / 8;
+
+	if (grow && shard->hottarget + WAF_BUFF_SIZE <= high)
+		shard->hottarget += WAF_BUFF_SIZE;
+	else if (!grow && shard->hottarget >= low + WAF_BUFF_SIZE)
+		shard->hottarget -= WAF_BUFF_SIZE;
+}
+
+static struct waf_cache_cold** waf_cache_cold_find(struct waf_cache_shard *shard, waf_size_t h, unsigned long serial, waf_size_t offset)
+{
+	struct waf_cache_cold **link = &shard->cold[(unsigned long)(h >> 16) & shard->coldmask];
+
+	while (*link && ((*link)->serial != serial || (*link)->offset != offset))
+		link = &(*link)->next;
+
+	return link;
+}
+
+/* evict the next compressed block the clock finds unused, called with the lock held */
+static void waf_cache_cold_evict(struct waf_cache_shard *shard)
+{
+	struct waf_cache_cold *prev = shard->coldhand;
+	struct waf_cache_cold *cold;
+	struct waf_cache_cold **link;
+	waf_size_t h;
+
+	for (;;)
+	{
+		cold = prev->ring;
+		if (!cold->used)
+			break;
+		cold->used = 0;
+		prev = cold;
+	}
+
+	/* unlink from the ring and the hash chain */
+	if (cold == prev)
+		shard->coldhand = NULL;
+	else
+	{
+		prev->ring = cold->ring;
+		shard->coldhand = prev;
+	}
+
+	h = waf_cache_hash(cold->serial, cold->offset);
+	link = waf_cache_cold_find(shard, h, cold->serial, cold->offset);
+	*link = cold->next;
+
+	/* a full miss on this block later means the cold tier was too small */
+	shard->ghosts[(unsigned long)(h >> 16) & shard->coldmask] = h;
+
+	shard->coldbytes -= sizeof(struct waf_cache_cold) + cold->payload;
+	free(cold);
+
+	waf_stats_local()->cache_evictions++;
+}
+
+/*
+copy a compressed block out of the cold tier after a hot miss, and learn
+from the outcome: a cold hit would have been a hot hit with more hot memory,
+a miss on a block the cold tier dropped would have been a cold hit
+*/
+static int waf_cache_cold_get(struct waf_cache *cache, unsigned long serial, waf_size_t offset, unsigned char *raw, waf_size_t *word)
+{
+	waf_size_t h = waf_cache_hash(serial, offset);
+	struct waf_cache_shard *shard = waf_cache_shard(cache, h);
+	struct waf_cache_cold *cold;
+	waf_size_t *ghost;
+	int found = 0;
+
+	waf_mutex_lock(&shard->lock);
+
+	cold = *waf_cache_cold_find(shard, h, serial, offset);
+	if (cold)
+	{
+		cold->used = 1;
+		*word = cold->word;
+		memcpy(raw, cold->data, (size_t)cold->payload);
+		waf_cache_adapt(shard, 1);
+		found = 1;
+	}
+	else
+	{
+		ghost = &shard->ghosts[(unsigned long)(h >> 16) & shard->coldmask];
+		if (*ghost == h)
+		{
+			*ghost = 0;
+			waf_cache_adapt(shard, 0);
+			waf_cache_shrink(shard);
+		}
+	}
+
+	waf_mutex_unlock(&shard->lock);
+
+	return found;
+}
+
+/* keep a compressed block read from the source */
+static void waf_cache_cold_put(struct waf_cache *cache, unsigned long serial, waf_size_t offset, waf_size_t word,
+	const unsigned char *data, waf_size_t payload)
+{
+	waf_size_t h = waf_cache_hash(serial, offset);
+	struct waf_cache_shard *shard = waf_cache_shard(cache, h);
+	waf_size_t size = sizeof(struct waf_cache_cold) + payload;
+	struct waf_cache_cold **link;
+	struct waf_cache_cold *cold;
+	waf_size_t limit;
+
+	waf_mutex_lock(&shard->lock);
+
+	/* the hot tier may not have shrunk to its target yet */
+	limit = shard->budget - WAF_MIN(shard->budget, shard->hotbytes > shard->hottarget ? shard->hotbytes : shard->hottarget);
+
+	link = waf_cache_cold_find(shard, h, serial, offset);
+	if (*link || size > limit)
+		goto __finish;
+
+	while (shard->coldhand && shard->coldbytes + size > limit)
+		waf_cache_cold_evict(shard);
+
+	cold = (struct waf_cache_cold*)malloc((size_t)size);
+	if (!cold)
+		goto __finish;
+
+	cold->serial = serial;
+	cold->offset = offset;
+	cold->word = word;
+	cold->payload = payload;
+	cold->used = 0;
+	memcpy(cold->data, data, (size_t)payload);
+
+	/* hash chains and evictions may have moved the link */
+	link = waf_cache_cold_find(shard, h, serial, offset);
+	cold->next = NULL;
+	*link = cold;
+
+	/* new blocks go behind the hand, last in line */
+	if (shard->coldhand)
+	{
+		cold->ring = shard->coldhand->ring;
+		shard->coldhand->ring = cold;
+	}
+	else
+		cold->ring = cold;
+	shard->coldhand = cold;
+
+	shard->coldbytes += size;
+
+__finish:
+	waf_mutex_unlock(&shard->lock);
+}
+
+/* go back to the file's own buffer */
+static void waf_unpin_block(struct waf_file *file)
+{
+	if (file->pinned)
+	{
+		waf_cache_unpin(file->pinned);
+		file->pinned = NULL;
+	}
+
+#ifndef _WIN32
+	if (file->mapped)
+	{
+		munmap(file->mapped, (size_t)file->mappedsize);
+		file->mapped = NULL;
+	}
+#endif
+
+	file->cbuf = file->cdata;
+}
+
+waf_size_t waf_count(struct waf_archive *arc)
+{
+	assert(arc != NULL);
+
+	return arc->count;
+}
+
+waf_size_t waf_find(struct waf_archive *arc, const char *filename)
+{
+	waf_size_t id;
+
+	assert(arc != NULL);
+	assert(filename != NULL);
+
+	if (waf_find_entry(arc, filename, &id) != 0)
+		return WAF_NO_ID;
+
+	return id;
+}
+
+struct waf_file* waf_open_id(struct waf_archive *arc, waf_size_t id)
+{
+	waf_stats *stats = waf_stats_local();
+	waf_size_t start = waf_clock();
+	struct waf_file *file = NULL;
+	struct waf_inf inf;
+
+	assert(arc != NULL);
+
+	WAF_PROBE1(open_start, NULL);
+
+	if (waf_entry(arc, id, &inf) == 0)
+		file = waf_open_inf(arc, &inf);
+	if (file)
+		file->id = id;
+
+	WAF_PROBE2(open_end, id, file);
+
+	if (file)
+		stats->opens++;
+	waf_stats_time(stats, WAF_OP_OPEN, start);
+	WAF_TRACE_SPAN(WAF_EVENT_OPEN, start, id, file ? file->inf.size : 0);
+
+	return file;
+}
+
+waf_size_t waf_size_id(struct waf_archive *arc, waf_size_t id)
+{
+	struct waf_inf inf;
+
+	assert(arc != NULL);
+
+	if (waf_entry(arc, id, &inf) != 0)
+		return WAF_NO_ID;
+
+	return inf.size;
+}
+
+static void waf_free_window(struct waf_file *file)
+{
+	if (file->window)
+	{
+		waf_buf_free(file->arc, file->window);
+		file->window = NULL;
+	}
+
+	file->nspans = 0;
+}
+
+void waf_close(struct waf_file *file)
+{
+	if (file)
+	{
+		if (file->fast_offset)
+		{
+			free(file->fast_offset);
+			file->fast_offset = NULL;
+		}
+
+		if (file->chunk_start)
+		{
+			free(file->chunk_start);
+			file->chunk_start = NULL;
+		}
+
+		if (file->dbuf)
+		{
+			free(file->dbuf);
+			file->dbuf = NULL;
+		}
+
+		if (file->base)
+		{
+			waf_close(file->base);
+			file->base = NULL;
+		}
+
+		waf_free_window(file);
+		waf_unpin_block(file);
+
+		memset(file, 0, sizeof(struct waf_file));
+		free(file);
+	}
+}
+
+waf_size_t waf_size(struct waf_file *file)
+{
+	if (file)
+		return file->inf.size;
+	return 0;
+}
+
+/* uncompress a block with the archive's compression settings */
+static int waf_uncompress_block(struct waf_file *file, const unsigned char *raw, waf_size_t bs, unsigned char *out, waf_size_t *outsize)
+{
+	waf_stats *stats = waf_stats_local();
+	waf_size_t start = waf_clock();
+	int result;
+
+	WAF_PROBE2(inflate_start, file->np, bs);
+
+	if (file->arc->dict)
+		result = WAF_DECOMPRESS_DICT(raw, bs, out, *outsize, file->arc->dict, file->arc->dictsize);
+	else
+		result = WAF_DECOMPRESS(raw, bs, out, *outsize);
+
+	WAF_PROBE3(inflate_end, file->np, *outsize, result);
+
+	stats->inflates++;
+	if (result == 0)
+		stats->inflated_bytes += *outsize;
+	stats->inflate_ns += waf_stats_time(stats, WAF_OP_INFLATE, start);
+	WAF_TRACE_SPAN(WAF_EVENT_INFLATE, start, bs, result == 0 ? *outsize : 0);
+
+	return result;
+}
+
+/* rebuild a block from delta instructions against the base file */
+static int waf_apply_delta(struct waf_file *file, const unsigned char *ops, waf_size_t size)
+{
+	waf_size_t i = 0;
+	waf_size_t out = 0;
+
+	if (!file->base)
+	{
+		struct waf_inf inf;
+
+		if (waf_find_base(file->arc, file->base_ref, &inf) == 0)
+			file->base = waf_open_inf(file->arc, &inf);
+
+		if (!file->base)
+			return -1;
+	}
+
+	while (i < size)
+	{
+		unsigned char op = ops[i++];
+		waf_size_t len;
+
+		if (op == WAF_DELTA_COPY)
+		{
+			waf_size_t pos;
+
+			if (size - i < WAF_U32_SIZE * 2)
+				return -1;
+
+			pos = WAF_U32(&ops[i]);
+			len = WAF_U32(&ops[i + WAF_U32_SIZE]);
+			i += WAF_U32_SIZE * 2;
+
+			if (len > WAF_BUFF_SIZE - out || waf_seekabs(file->base, pos) != 0)
+				return -1;
+
+			if (waf_read(file->base, &file->cdata[out], &len) != 0)
+				return -1;
+		}
+		else if (op == WAF_DELTA_ADD)
+		{
+			if (size - i < WAF_U32_SIZE)
+				return -1;
+
+			len = WAF_U32(&ops[i]);
+			i += WAF_U32_SIZE;
+
+			if (len > size - i || len > WAF_BUFF_SIZE - out)
+				return -1;
+
+			memcpy(&file->cdata[out], &ops[i], len);
+			i += len;
+		}
+		else
+		{
+			return -1;  /* bad instruction */
+		}
+
+		out += len;
+	}
+
+	file->csize = out;
+
+	return 0;
+}
+
+/* find the window span holding a range of archive data */
+static const unsigned char* waf_span_find(struct waf_file *file, waf_size_t pos, waf_size_t len)
+{
+	waf_size_t i;
+
+	for (i = 0; i < file->nspans; i++)
+	{
+		struct waf_span *span = &file->spans[i];
+
+		if (pos >= span->start && pos - span->start <= span->size && len <= span->size - (pos - span->start))
+			return &span->data[pos - span->start];
+	}
 
 	return NULL;
 }
 
-void waf_close(struct waf_file *file)
+/* get archive data in place from memory or the window, otherwise read it into scratch */
+static const unsigned char* waf_fetch(struct waf_file *file, waf_size_t pos, waf_size_t len, unsigned char *scratch)
 {
-	if (file)
+	struct waf_archive *arc = file->arc;
+	const unsigned char *data;
+
+	if (arc->mem)
 	{
-		if (file->fast_offset)
-		{
-			free(file->fast_offset);
-			file->fast_offset = NULL;
-		}
+		if (pos > arc->memsize || len > arc->memsize - pos)
+			return NULL;
 
-		memset(file, 0, sizeof(struct waf_file));
-		free(file);
+		return &arc->mem[pos];
 	}
+
+	data = waf_span_find(file, pos, len);
+	if (data)
+		return data;
+
+	if (waf_pread(arc, pos, scratch, len) != 0)
+		return NULL;
+
+	return scratch;
 }
 
-waf_size_t waf_size(struct waf_file *file)
+/* fetch the next chunks of a chunked file in two batches, block sizes first */
+static void waf_load_chunks_window(struct waf_file *file, waf_size_t blocks)
 {
-	if (file)
-		return file->inf->size;
-	return 0;
+	unsigned char words[WAF_BATCH_SIZE * WAF_U32_SIZE];
+	waf_io_req reqs[WAF_BATCH_SIZE];
+	waf_size_t count = WAF_MIN(WAF_MIN(file->blocks - file->nb, WAF_BATCH_SIZE), blocks);
+	waf_size_t size = 0;
+	waf_size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		reqs[i].pos = file->fast_offset[file->nb + i];
+		reqs[i].buff = &words[i * WAF_U32_SIZE];
+		reqs[i].len = WAF_U32_SIZE;
+	}
+
+	if (waf_pread_batch(file->arc, reqs, count) != 0)
+		return;
+
+	/* take as many chunks as fit in the window, at least one */
+	for (i = 0; i < count; i++)
+	{
+		waf_size_t len = WAF_U32_SIZE + WAF_PAYLOAD(WAF_U32(&words[i * WAF_U32_SIZE]));
+
+		if (len > WAF_U32_SIZE + WAF_RAW_SIZE || (i > 0 && size + len > WAF_WINDOW_SIZE))
+			break;
+
+		file->spans[i].start = reqs[i].pos;
+		file->spans[i].size = len;
+		size += len;
+	}
+	count = i;
+
+	file->window = (unsigned char*)waf_buf_alloc(file->arc, size);
+	if (!file->window)
+		return;  /* read block by block */
+
+	for (i = 0, size = 0; i < count; i++)
+	{
+		file->spans[i].data = &file->window[size];
+		reqs[i].pos = file->spans[i].start;
+		reqs[i].buff = &file->window[size];
+		reqs[i].len = file->spans[i].size;
+		size += file->spans[i].size;
+	}
+
+	if (waf_pread_batch(file->arc, reqs, count) != 0)
+	{
+		waf_free_window(file);
+		return;
+	}
+
+	file->nspans = count;
+}
+
+/*
+fetch the compressed data of the blocks a read of want more bytes covers,
+split in segments the source reads in one batch. the window stays with the
+file, so the next read goes on from it
+*/
+static void waf_load_window(struct waf_file *file, waf_size_t want)
+{
+	waf_io_req reqs[WAF_WINDOW_SIZE / WAF_IO_SEGMENT];
+	waf_size_t end = file->inf.offset + file->inf.extent;
+	waf_size_t next = file->np;
+	waf_size_t blocks = (want + WAF_BUFF_SIZE - 1) / WAF_BUFF_SIZE + 1;  /* the read may start mid-block */
+	const unsigned char *word;
+	waf_size_t size;
+	waf_size_t count;
+	waf_size_t i;
+
+	/* memory archives need no window */
+	if (file->arc->mem)
+		return;
+
+	if (file->chunk_start)
+	{
+		/* chunks are scattered over the archive, only worth a batch when the source has one */
+		if (!file->arc->io.read_batch || file->nb >= file->blocks)
+			return;
+		next = file->fast_offset[file->nb];
+	}
+	else if (file->inf.extent == 0 || file->np >= end)
+	{
+		return;
+	}
+
+	/* still covered, block size and data */
+	word = waf_span_find(file, next, WAF_U32_SIZE);
+	if (word && waf_span_find(file, next, WAF_U32_SIZE + WAF_PAYLOAD(WAF_U32(word))))
+		return;
+
+	waf_free_window(file);
+
+	if (file->chunk_start)
+	{
+		waf_load_chunks_window(file, blocks);
+		return;
+	}
+
+	size = WAF_MIN(end - file->np, WAF_MIN(blocks * (WAF_U32_SIZE + WAF_RAW_SIZE), WAF_WINDOW_SIZE));
+
+	file->window = (unsigned char*)waf_buf_alloc(file->arc, size);
+	if (!file->window)
+		return;  /* read block by block */
+
+	count = file->arc->io.read_batch ? (size + WAF_IO_SEGMENT - 1) / WAF_IO_SEGMENT : 1;
+	for (i = 0; i < count; i++)
+	{
+		reqs[i].pos = file->np + i * WAF_IO_SEGMENT;
+		reqs[i].buff = &file->window[i * WAF_IO_SEGMENT];
+		reqs[i].len = (i + 1 < count) ? WAF_IO_SEGMENT : size - i * WAF_IO_SEGMENT;
+	}
+
+	if (waf_pread_batch(file->arc, reqs, count) != 0)
+	{
+		waf_free_window(file);
+		return;
+	}
+
+	file->spans[0].start = file->np;
+	file->spans[0].size = size;
+	file->spans[0].data = file->window;
+	file->nspans = 1;
+}
+
+/* uncompressed size of the next block */
+static waf_size_t waf_block_length(struct waf_file *file)
+{
+	if (file->chunk_start)
+		return file->chunk_start[file->nb + 1] - file->chunk_start[file->nb];
+
+	return WAF_MIN(WAF_BUFF_SIZE, file->inf.size - file->nb * WAF_BUFF_SIZE);
 }
 
 static int waf_next_block(struct waf_file *file)
 {
 	unsigned char raw[WAF_RAW_SIZE];
+	const unsigned char *data;
+	struct waf_cache *cache = file->arc->cache;
+	waf_stats *stats = waf_stats_local();
 	waf_size_t bs;
+	waf_size_t type;
+	int tier = -1;
+	int coldtier;
+	int cold;
+
+	if (file->chunk_start)
+	{
+		/* chunks of a file are not contiguous, take the offset from the list */
+		if (file->nb >= file->blocks)
+			return READ_STATUS_EOF;
+
+		file->np = file->fast_offset[file->nb];
+	}
+	else if (file->nb >= file->blocks)
+	{
+		/* past the last block, no need to read the terminator from the source */
+		return READ_STATUS_EOF;
+	}
+
+	/* caches in this process hand out blocks in place */
+	if (cache && !cache->shm && !cache->disk)
+	{
+		struct waf_cache_block *block = waf_cache_lookup(cache, file->arc->serial, file->np);
+
+		if (block)
+		{
+			waf_unpin_block(file);
+			file->pinned = block;
+			file->cbuf = block->data;
+			file->csize = block->size;
+			bs = block->payload;
+			stats->cache_hits++;
+			WAF_PROBE2(cache_hit, file->np, WAF_TIER_HOT);
+			WAF_TRACE_MARK(WAF_EVENT_HIT, file->np, WAF_TIER_HOT);
+			goto __advance;
+		}
+	}
+
+	/*
+	the pinned or mapped block is gone and cdata is about to be overwritten,
+	so no block is loaded until one is, an eof or failure leaves none for seeks
+	*/
+	waf_unpin_block(file);
+	file->cp = ~0;
+	file->coff = file->csize = 0;
+
+#ifndef _WIN32
+	if (cache && cache->shm && waf_shm_get(cache->shm, file->arc->ident, file->np, file->cdata, &file->csize, &bs))
+		tier = WAF_TIER_SHARED;
+	else if (cache && cache->disk && waf_disk_get(cache->disk, file, &bs))
+		tier = WAF_TIER_DISK;
+
+	if (tier >= 0)
+	{
+		stats->cache_hits++;
+		WAF_PROBE2(cache_hit, file->np, tier);
+		WAF_TRACE_MARK(WAF_EVENT_HIT, file->np, tier);
+		goto __advance;
+	}
+#endif
 
-	fseek(file->fp, file->np, SEEK_SET);
+	/* compressed blocks are worth keeping when the source is not memory, a cold hit leaves one in raw */
+	coldtier = cache && cache->tiered && !file->arc->mem;
+	cold = coldtier && waf_cache_cold_get(cache, file->arc->serial, file->np, raw, &bs);
 
-	if (waf_readsize(file->fp, &bs) != 0)
-		return READ_STATUS_FAILED;
+	if (cold)
+	{
+		stats->cache_cold_hits++;
+		WAF_PROBE2(cache_hit, file->np, WAF_TIER_COLD);
+		WAF_TRACE_MARK(WAF_EVENT_HIT, file->np, WAF_TIER_COLD);
+	}
+	else
+	{
+		data = waf_fetch(file, file->np, WAF_U32_SIZE, raw);
+		if (!data)
+			return READ_STATUS_FAILED;
+
+		bs = WAF_U32(data);
+	}
 
 	if (bs == 0)
 		return READ_STATUS_EOF;
 
-	if (bs > WAF_RAW_SIZE)
-		return READ_STATUS_FAILED;
+	type = bs & WAF_BLOCK_TYPE_MASK;
+
+	if (type == WAF_BLOCK_FILL)
+	{
+		/* constant block, nothing to read or inflate */
+		if (file->nb >= file->blocks)
+			return READ_STATUS_FAILED;
+
+		file->csize = waf_block_length(file);
+		memset(file->cdata, (int)(bs & 0xff), file->csize);
+		bs = 0;
+	}
+	else
+	{
+		bs &= ~WAF_BLOCK_TYPE_MASK;
+
+		if (bs > WAF_RAW_SIZE)
+			return READ_STATUS_FAILED;
+
+		/* fill blocks are never cached, they are not misses */
+		if (cache && !cold)
+		{
+			stats->cache_misses++;
+			WAF_PROBE1(cache_miss, file->np);
+			WAF_TRACE_MARK(WAF_EVENT_MISS, file->np, 0);
+		}
+
+		if (cold)
+			data = raw;
+		else
+		{
+			data = waf_fetch(file, file->np + WAF_U32_SIZE, bs, raw);
+			if (!data)
+				return READ_STATUS_FAILED;
+
+			if (coldtier)
+				waf_cache_cold_put(cache, file->arc->serial, file->np, bs | type, data, bs);
+		}
+
+		if (type == WAF_BLOCK_DELTA)
+		{
+			waf_size_t opsize = WAF_RAW_SIZE;
+
+			if (!file->dbuf)
+				file->dbuf = (unsigned char*)malloc(WAF_RAW_SIZE);
+			if (!file->dbuf)
+				return READ_STATUS_FAILED;
+
+			if (waf_uncompress_block(file, data, bs, file->dbuf, &opsize) != 0)
+				return READ_STATUS_FAILED;
 
-	if (fread(raw, 1, bs, file->fp) != bs || ferror(file->fp))
-		return READ_STATUS_FAILED;
+			if (waf_apply_delta(file, file->dbuf, opsize) != 0)
+				return READ_STATUS_FAILED;
+		}
+		else
+		{
+			file->csize = WAF_BUFF_SIZE;
+			if (waf_uncompress_block(file, data, bs, file->cdata, &file->csize) != 0)
+				return READ_STATUS_FAILED;
+		}
 
-	file->csize = WAF_BUFF_SIZE;
-	if (WAF_DECOMPRESS(raw, bs, file->cdata, file->csize) != 0)
-		return READ_STATUS_FAILED;
+#ifndef _WIN32
+		if (cache && cache->shm)
+			waf_shm_put(cache->shm, file->arc->ident, file->np, file->cdata, file->csize, bs);
+		else if (cache && cache->disk)
+			waf_disk_put(cache->disk, file->arc->ident, file->np, file->cdata, file->csize, bs);
+		else
+#endif
+		if (cache)
+			waf_cache_insert(cache, file->arc->serial, file->np, file->cdata, file->csize, bs);
+	}
 
+__advance:
 	file->coff = 0;
 	file->cp = file->np;
-	file->np += sizeof(waf_size_t);
+	file->np += WAF_U32_SIZE;
 	file->np += bs;
+	file->nb++;
+
+	/* remember where the next block starts */
+	if (!file->chunk_start && file->nb <= file->blocks)
+		file->fast_offset[file->nb] = file->np;
 
 	return READ_STATUS_SUCCESS;
 }
 
+int waf_archive_record(struct waf_archive *arc, const char *filename)
+{
+	FILE *fp = NULL;
+
+	assert(arc != NULL);
+
+	if (filename)
+	{
+		fp = fopen(filename, "w");
+		if (!fp)
+			return -1;
+	}
+
+	waf_mutex_lock(&arc->recordlock);
+	if (arc->record)
+		fclose(arc->record);
+	arc->record = fp;
+	arc->recordstart = waf_clock();
+	waf_mutex_unlock(&arc->recordlock);
+
+	return 0;
+}
+
+/* add a read to the access trace: time in microseconds, position, bytes and entry name */
+static void waf_record(struct waf_file *file, waf_size_t position, waf_size_t size)
+{
+	struct waf_archive *arc = file->arc;
+	char name[WAF_FILENAME_SIZE];
+	waf_size_t now = waf_clock();
+
+	/* base files of deltas are read on behalf of the entry being read */
+	if (file->id == WAF_NO_ID)
+		return;
+
+	if (arc->index)
+	{
+		if (waf_entry_name(arc, file->id, name) != 0)
+			return;
+	}
+	else
+		strcpy(name, file->inf.name);
+
+	waf_mutex_lock(&arc->recordlock);
+	if (arc->record)
+		fprintf(arc->record, "%.0f %.0f %.0f %s\n", (double)(now - arc->recordstart) / 1000.0, (double)position, (double)size, name);
+	waf_mutex_unlock(&arc->recordlock);
+}
+
 int waf_read(struct waf_file *file, void *buff, waf_size_t *readsize)
 {
 	waf_size_t datasize = 0;
 	unsigned char *buf = (unsigned char*)buff;
+	waf_size_t position;
+	waf_size_t start;
+	int windowed;
+	int result = 0;
 
 	assert(buff != NULL);
 	assert(readsize != NULL);
@@ -348,27 +3065,44 @@ int waf_read(struct waf_file *file, void *buff, waf_size_t *readsize)
 	if (!file)
 		return -1;
 
+	start = waf_clock();
+	position = file->cur;
+	WAF_PROBE2(read_start, position, *readsize);
+
+	/*
+	large or whole-file reads fetch the compressed extent at once, but not with
+	a cache, which holds the blocks the window would fetch again from the source
+	*/
+	windowed = !file->arc->cache && *readsize > file->csize - file->coff &&
+		(*readsize > WAF_BUFF_SIZE || *readsize >= file->inf.size - file->cur);
+
 	while (1)
 	{
 		waf_size_t copysize;
 
 		if (file->coff >= file->csize)
 		{
-			int read_status = waf_next_block(file);
+			int read_status;
+
+			if (windowed)
+				waf_load_window(file, *readsize - datasize);
+
+			read_status = waf_next_block(file);
 
 			if (read_status == READ_STATUS_FAILED)
 			{
-				return -1;
+				result = -1;
+				break;
 			}
 			else if (read_status == READ_STATUS_EOF)
 			{
-				*readsize = datasize;
-				return 1;
+				result = 1;
+				break;
 			}
 		}
 
 		copysize = WAF_MIN(*readsize - datasize, file->csize - file->coff);
-		memcpy(&buf[datasize], &file->cdata[file->coff], copysize);
+		memcpy(&buf[datasize], &file->cbuf[file->coff], copysize);
 
 		datasize += copysize;
 		file->coff += copysize;
@@ -378,14 +3112,29 @@ int waf_read(struct waf_file *file, void *buff, waf_size_t *readsize)
 			break;
 	}
 
-	*readsize = datasize;
-	return 0;
+	/* the window serves the next read, unless the file is done */
+	if (file->cur >= file->inf.size)
+		waf_free_window(file);
+
+	if (result >= 0)
+		*readsize = datasize;
+
+	WAF_PROBE3(read_end, position, datasize, result);
+	if (file->arc->record && datasize > 0)
+		waf_record(file, position, datasize);
+	waf_stats_time(waf_stats_local(), WAF_OP_READ, start);
+	WAF_TRACE_SPAN(WAF_EVENT_READ, start, position, datasize);
+
+	return result;
 }
 
-int waf_seekabs(struct waf_file *file, waf_size_t position)
+/* move to position, loading the block that holds it */
+static int waf_seekto(struct waf_file *file, waf_size_t position, waf_stats *stats)
 {
 	waf_size_t block;
 	waf_size_t start;
+	waf_size_t blockpos;
+	int read_status;
 
 	assert(position >= 0);
 
@@ -394,57 +3143,120 @@ int waf_seekabs(struct waf_file *file, waf_size_t position)
 
 	position = WAF_MIN(position, waf_size(file));
 
-	block = position / WAF_BUFF_SIZE;
-	start = file->inf->offset;
-
-	if (file->fast_offset[block] > 0)
+	if (file->chunk_start)
 	{
-		/* use the pre-calculated offset */
+		waf_size_t lo = 0;
+		waf_size_t hi = file->blocks;
+
+		if (file->blocks == 0)
+		{
+			/* empty file */
+			file->coff = file->csize = 0;
+			file->cur = 0;
+			return 0;
+		}
+
+		/* find the last chunk starting at or before position */
+		while (hi - lo > 1)
+		{
+			waf_size_t mid = (lo + hi) / 2;
+
+			if (file->chunk_start[mid] <= position)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		block = lo;
+		blockpos = file->chunk_start[block];
 		start = file->fast_offset[block];
 	}
 	else
 	{
-		/* no pre-calculated offset found, we have to calculate it */
-		waf_size_t i;
-		waf_size_t bs;
+		block = position / WAF_BUFF_SIZE;
+		blockpos = block * WAF_BUFF_SIZE;
+		start = file->fast_offset[0];
 
-		fseek(file->fp, start, SEEK_SET);
-
-		for (i = 0; i < block; i++)
+		if (file->fast_offset[block] > 0)
 		{
-			if (waf_readsize(file->fp, &bs) != 0 || bs > WAF_RAW_SIZE)
-				return -1;
-
-			fseek(file->fp, bs, SEEK_CUR);
+			/* use the pre-calculated offset */
+			start = file->fast_offset[block];
+		}
+		else
+		{
+			/* no pre-calculated offset found, we have to calculate it */
+			waf_size_t i;
+			waf_size_t bs;
 
-			start += sizeof(waf_size_t);
-			start += bs;
-			
-			/* save next block's offset */
-			file->fast_offset[i + 1] = start;
+			for (i = 0; i < block; i++)
+			{
+				stats->seek_walks++;
+				if (waf_readsize(file->arc, &start, &bs) != 0)
+					return -1;
+
+				bs = WAF_PAYLOAD(bs);
+				if (bs > WAF_RAW_SIZE)
+					return -1;
+
+				start += bs;
+				
+				/* save next block's offset */
+				file->fast_offset[i + 1] = start;
+			}
 		}
 	}
 
+	WAF_PROBE3(seek_resolve, position, block, start);
+
 	/* read data block if necessary */
 	if (file->cp < 0 || file->cp != start)
 	{
 		waf_size_t prev = file->np;
+		waf_size_t prevnb = file->nb;
 		file->np = start;
+		file->nb = block;
 
-		if (waf_next_block(file) == READ_STATUS_FAILED)
+		read_status = waf_next_block(file);
+		if (read_status == READ_STATUS_FAILED)
 		{
 			file->np = prev;
+			file->nb = prevnb;
 			return -1;
 		}
+		else if (read_status == READ_STATUS_EOF)
+		{
+			/* seek to the end, drop the stale buffer */
+			file->cp = ~0;
+			file->csize = 0;
+		}
+	}
+	else
+	{
+		/* shared chunks may appear twice in a file, keep reading after this one */
+		file->nb = block + 1;
 	}
 
-	file->coff = position % WAF_BUFF_SIZE;
+	file->coff = position - blockpos;
 	file->cur = position;
 
 	return 0;
 }
 
-int waf_seek(struct waf_file *file, int offset, int origin)
+int waf_seekabs(struct waf_file *file, waf_size_t position)
+{
+	waf_stats *stats = waf_stats_local();
+	waf_size_t start = waf_clock();
+	waf_size_t walks = stats->seek_walks;
+	int result = waf_seekto(file, position, stats);
+
+	stats->seeks++;
+	waf_stats_time(stats, WAF_OP_SEEK, start);
+	WAF_TRACE_SPAN(WAF_EVENT_SEEK, start, position, stats->seek_walks - walks);
+
+	return result;
+}
+
+int waf_seek(struct waf_file *file, waf_off_t offset, int origin)
 {
 	if (!file)
 		return -1;
@@ -454,16 +3266,19 @@ int waf_seek(struct waf_file *file, int offset, int origin)
 	case SEEK_SET:
 		break;
 	case SEEK_CUR:
-		offset = file->cur + offset;
+		offset = (waf_off_t)file->cur + offset;
 		break;
 	case SEEK_END:
-		offset = waf_size(file) + offset;
+		offset = (waf_off_t)waf_size(file) + offset;
 		break;
 	default:
 		return -1;
 	}
 
-	return waf_seekabs(file, offset);
+	if (offset < 0)
+		return -1;
+
+	return waf_seekabs(file, (waf_size_t)offset);
 }
 
 waf_size_t waf_tell(struct waf_file *file)
@@ -474,6 +3289,189 @@ waf_size_t waf_tell(struct waf_file *file)
 	return file->cur;
 }
 
+/* match a name against the rest of a glob pattern, start is the whole pattern */
+static int waf_match_from(const char *start, const char *pattern, const char *name)
+{
+	for (; *pattern; pattern++, name++)
+	{
+		if (*pattern == '*')
+		{
+			/* '*' stays inside a directory, '**' crosses them */
+			int deep = (pattern[1] == '*');
+
+			/* a '**' filling a whole component may also match no directory, the components a, '**', b match a/b */
+			if (deep && pattern[2] == '/' && (pattern == start || pattern[-1] == '/') &&
+				waf_match_from(start, pattern + 3, name))
+				return 1;
+
+			pattern += deep ? 2 : 1;
+			for (;; name++)
+			{
+				if (waf_match_from(start, pattern, name))
+					return 1;
+				if (!*name || (!deep && *name == '/'))
+					return 0;
+			}
+		}
+
+		if (!*name)
+			return 0;
+
+		if (*pattern == '?')
+		{
+			if (*name == '/')
+				return 0;
+		}
+		else if (*pattern == '[' && strchr(pattern + 2, ']'))
+		{
+			const unsigned char *p = (const unsigned char*)pattern + 1;
+			unsigned char c = (unsigned char)*name;
+			int negate = (*p == '!');
+			int found = 0;
+
+			p += negate;
+			do  /* a ']' first in the class is a member */
+			{
+				if (p[1] == '-' && p[2] && p[2] != ']')
+				{
+					found = found || (c >= p[0] && c <= p[2]);
+					p += 3;
+				}
+				else
+				{
+					found = found || (c == *p);
+					p++;
+				}
+			} while (*p && *p != ']');
+
+			if (!*p || found == negate || c == '/')
+				return 0;
+			pattern = (const char*)p;
+		}
+		else if (*pattern != *name)
+		{
+			return 0;
+		}
+	}
+
+	return *name == 0;
+}
+
+/* match a name against a glob pattern */
+static int waf_match(const char *pattern, const char *name)
+{
+	return waf_match_from(pattern, pattern, name);
+}
+
+/* start an enumeration at the first name not before the prefix */
+static int waf_iter_start(struct waf_archive *arc, const char *prefix, size_t prefixlen, const char *pattern, waf_iter *it)
+{
+	waf_size_t lo = 0;
+	waf_size_t hi;
+
+	it->arc = arc;
+	it->prefix = prefix;
+	it->prefixlen = prefixlen;
+	it->pattern = pattern;
+	it->id = WAF_NO_ID;
+	it->next = 0;
+	it->pos = 0;
+	it->name[0] = 0;
+	it->size = 0;
+
+	if (!arc->index || arc->count == 0)
+		return 0;
+
+	/* binary search for the last block whose first name sorts before the prefix */
+	hi = WAF_RESTARTS(arc->count);
+	while (hi - lo > 1)
+	{
+		waf_size_t mid = lo + (hi - lo) / 2;
+		waf_size_t pos = waf_restart(arc, mid);
+
+		it->name[0] = 0;
+		if (waf_next_name(arc, &pos, it->name) != 0)
+			return -1;
+
+		if (strncmp(it->name, prefix, prefixlen) < 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	it->next = lo * WAF_RESTART_INTERVAL;
+	it->pos = waf_restart(arc, lo);
+	it->name[0] = 0;
+
+	return 0;
+}
+
+int waf_list(struct waf_archive *arc, const char *prefix, waf_iter *it)
+{
+	assert(arc != NULL);
+	assert(prefix != NULL);
+	assert(it != NULL);
+
+	return waf_iter_start(arc, prefix, strlen(prefix), NULL, it);
+}
+
+int waf_glob(struct waf_archive *arc, const char *pattern, waf_iter *it)
+{
+	assert(arc != NULL);
+	assert(pattern != NULL);
+	assert(it != NULL);
+
+	/* only names starting with the literal part of the pattern are visited */
+	return waf_iter_start(arc, pattern, strcspn(pattern, "*?["), pattern, it);
+}
+
+int waf_next(waf_iter *it)
+{
+	struct waf_archive *arc = it->arc;
+	struct waf_inf inf;
+	int cmp;
+
+	for (; it->next < arc->count; it->next++)
+	{
+		if (!arc->index)
+		{
+			/* old archives are not sorted, every entry is checked */
+			if (waf_entry(arc, it->next, &inf) != 0)
+				return -1;  /* the name comes with the entry */
+			if (strncmp(inf.name, it->prefix, it->prefixlen) != 0)
+				continue;
+			strcpy(it->name, inf.name);
+		}
+		else
+		{
+			/* names are decoded in order, each from the one before */
+			if (waf_next_name(arc, &it->pos, it->name) != 0)
+				return -1;
+
+			cmp = strncmp(it->name, it->prefix, it->prefixlen);
+			if (cmp < 0)
+				continue;
+			if (cmp > 0)
+				break;  /* past the prefix, nothing further matches */
+
+			if (WAF_U32(&arc->refs[it->next * WAF_U32_SIZE]) >= arc->ndata)
+				return -1;
+			waf_data(arc, WAF_U32(&arc->refs[it->next * WAF_U32_SIZE]), &inf);
+		}
+
+		if (it->pattern && !waf_match(it->pattern, it->name))
+			continue;
+
+		it->size = inf.size;
+		it->id = it->next++;
+		return 0;
+	}
+
+	it->next = arc->count;
+
+	return 1;
+}
+
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
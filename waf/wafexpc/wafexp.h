@@ -29,15 +29,135 @@ wane <newsheep@gmail.com>
 #ifndef __WAF_EXP_H__
 #define __WAF_EXP_H__
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-typedef unsigned long waf_size_t;
+/* sizes and offsets are 64-bit, archives and files may exceed 4 GB */
+#ifdef _MSC_VER
+typedef unsigned __int64 waf_size_t;
+typedef __int64 waf_off_t;
+#else
+typedef unsigned long long waf_size_t;
+typedef long long waf_off_t;
+#endif
 
 typedef struct waf_file waf_file;
 typedef struct waf_archive waf_archive;
+typedef struct waf_mount waf_mount;
+typedef struct waf_cache waf_cache;
+typedef struct waf_request waf_request;
+
+/* returned for names that are not in the archive */
+#define WAF_NO_ID (~(waf_size_t)0)
+
+/* async request priorities, more urgent requests run first */
+#define WAF_PRIORITY_URGENT 0
+#define WAF_PRIORITY_NORMAL 1
+#define WAF_PRIORITY_BACKGROUND 2
+#define WAF_PRIORITY_COUNT 3
+
+/* async request results besides 0 (success) and -1 (failed) */
+#define WAF_PENDING 1
+#define WAF_CANCELLED (-2)
+
+/* job run by the pool or an external job system */
+typedef void (*waf_job_proc)(void *arg);
+
+/* hook for an existing job system, submit returns 0 once it has taken the job */
+typedef struct waf_executor
+{
+	void *user;
+	int (*submit)(void *user, waf_job_proc proc, void *arg);
+} waf_executor;
+
+/*
+called when a request completes, fails or is cancelled. it runs on a worker
+thread, except for a request still queued when waf_request_cancel or
+waf_async_stop is called, whose callback runs at once on the calling thread
+*/
+typedef void (*waf_read_callback)(waf_request *req, int result, waf_size_t size, void *user);
+
+/* timed operations, latencies are histograms of power of 2 nanoseconds */
+#define WAF_OP_OPEN 0  /* waf_open and waf_open_id */
+#define WAF_OP_READ 1  /* waf_read */
+#define WAF_OP_SEEK 2  /* waf_seek and waf_seekabs */
+#define WAF_OP_IO 3  /* one read, or batch of reads, from the archive source */
+#define WAF_OP_INFLATE 4  /* one block inflated */
+#define WAF_OP_COUNT 5
+#define WAF_STATS_BUCKETS 32
+
+/* reader counters, totals of every thread since the process started */
+typedef struct waf_stats
+{
+	waf_size_t opens;  /* files opened */
+	waf_size_t lookups;  /* names looked up */
+	waf_size_t probes;  /* entries compared by lookups, probes / lookups is the mean probe length */
+	waf_size_t io_reads;  /* reads from files and custom sources, archives in memory are not counted */
+	waf_size_t io_bytes;
+	waf_size_t io_ns;
+	waf_size_t inflates;  /* blocks inflated */
+	waf_size_t inflated_bytes;
+	waf_size_t inflate_ns;
+	waf_size_t cache_hits;  /* blocks served without reading or inflating */
+	waf_size_t cache_cold_hits;  /* blocks inflated from a compressed copy in the cold tier */
+	waf_size_t cache_misses;
+	waf_size_t cache_evictions;  /* blocks dropped by any tier to make room */
+	waf_size_t seeks;
+	waf_size_t seek_walks;  /* block headers read by seeks to find the block of a position */
+
+	/* latency[op][i] counts operations that took from 2^i to 2^(i+1) nanoseconds, the last bucket holds the slower ones */
+	waf_size_t latency[WAF_OP_COUNT][WAF_STATS_BUCKETS];
+} waf_stats;
+
+/* enumeration state, kept by the caller so no memory is allocated per entry */
+typedef struct waf_iter
+{
+	char name[260];  /* name of the current entry */
+	waf_size_t size;  /* size of the current entry */
+	waf_size_t id;  /* id of the current entry */
+
+	/* private */
+	waf_archive *arc;
+	const char *prefix;
+	size_t prefixlen;
+	const char *pattern;
+	waf_size_t next;
+	waf_size_t pos;
+} waf_iter;
+
+/* one read of a batch */
+typedef struct waf_io_req
+{
+	waf_size_t pos;
+	void *buff;
+	waf_size_t len;
+} waf_io_req;
+
+/* custom archive source, such as an async loader or a decrypting stream, unused fields must be zero */
+typedef struct waf_io
+{
+	void *user;  /* passed to the callbacks */
+
+	/* read len bytes at pos into buff, returns the number of bytes read */
+	waf_size_t (*read_at)(void *user, waf_size_t pos, void *buff, waf_size_t len);
+
+	/* total size of the source */
+	waf_size_t (*size)(void *user);
+
+	/* release the source when the archive is closed, may be NULL */
+	void (*close)(void *user);
+
+	/* optional: read every request in full, returns 0 if success */
+	int (*read_batch)(void *user, waf_io_req *reqs, waf_size_t count);
+
+	/* optional, both or neither: buffers the reader fills from the source */
+	void* (*alloc)(void *user, waf_size_t size);
+	void (*free)(void *user, void *ptr);
+} waf_io;
 
 /*
 open an archive
@@ -50,6 +170,47 @@ returns:
 */
 waf_archive* waf_archive_open(const char *filename, waf_size_t offset);
 
+/*
+open an archive in memory, blocks are inflated straight from it
+parameters:
+	[in] data - the archive, must stay valid until the archive is closed
+	[in] size - size of the archive
+returns:
+	pointer to the archive struct if success
+	otherwise failed
+*/
+waf_archive* waf_archive_open_memory(const void *data, waf_size_t size);
+
+/*
+open an archive read through callbacks
+parameters:
+	[in] io - the source callbacks, copied. close is called by
+	          waf_archive_close, not when opening fails
+	[in] offset - the archive's start offset in the source
+returns:
+	pointer to the archive struct if success
+	otherwise failed
+*/
+waf_archive* waf_archive_open_io(const waf_io *io, waf_size_t offset);
+
+/*
+open an archive file for batched reads. on linux, window and chunk reads
+are submitted to io_uring in batches, into registered buffers when the
+memlock limit allows. batches on different threads use rings of their own
+and overlap, up to WAF_URING_RINGS, then fall back to pread. the thread
+that submits a batch waits for it and inflates the blocks itself, there
+is no queue handing completions to other threads, so reads overlap across
+threads, as with waf_read_async. reads fall back to pread without
+io_uring, and other systems open the file like waf_archive_open
+parameters:
+	[in] filename - the archive's filename
+	[in] offset - the archive's start offset
+returns:
+	pointer to the archive struct if success
+	otherwise failed
+*/
+waf_archive* waf_archive_open_uring(const char *filename, waf_size_t offset);
+
 /*
 close an opened archive
 parameters:
@@ -68,6 +229,49 @@ returns:
 */
 waf_file* waf_open(waf_archive *arc, const char *filename);
 
+/*
+get the number of entries in an archive, entry ids run from 0 to count - 1
+parameters:
+	[in] arc - pointer to an opened archive
+returns:
+	number of entries
+*/
+waf_size_t waf_count(waf_archive *arc);
+
+/*
+find the id of an entry, ids follow the sorted names and stay the same
+for archives built from the same set of names
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] filename - name of the entry
+returns:
+	id of the entry if found
+	otherwise WAF_NO_ID
+*/
+waf_size_t waf_find(waf_archive *arc, const char *filename);
+
+/*
+open a file by its entry id, no name is hashed or compared
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] id - id of the entry
+returns:
+	pointer to the file inside the archive if success
+	otherwise failed
+*/
+waf_file* waf_open_id(waf_archive *arc, waf_size_t id);
+
+/*
+get the size of an entry without opening it
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] id - id of the entry
+returns:
+	size of the entry if success
+	otherwise WAF_NO_ID
+*/
+waf_size_t waf_size_id(waf_archive *arc, waf_size_t id);
+
 /*
 close a file
 parameters:
@@ -106,7 +310,7 @@ parameters:
 returns:
 	0 if success, otherwise failed
 */
-int waf_seek(waf_file *file, int offset, int origin);
+int waf_seek(waf_file *file, waf_off_t offset, int origin);
 
 /*
 return current position of a file
@@ -117,6 +321,327 @@ returns:
 */
 waf_size_t waf_tell(waf_file *file);
 
+/*
+create an empty mount, a set of archives looked up as one
+returns:
+	pointer to the mount if success
+	otherwise failed
+*/
+waf_mount* waf_mount_create(void);
+
+/*
+close a mount, the mounted archives are not closed
+parameters:
+	[in] mount - pointer to a mount
+*/
+void waf_mount_close(waf_mount *mount);
+
+/*
+add an archive to a mount, its files shadow files of the same name in
+archives added before. lookups may run on other threads meanwhile, but
+adds must not run concurrently with each other
+parameters:
+	[in] mount - pointer to a mount
+	[in] arc - pointer to an opened archive, kept open while mounted
+returns:
+	0 if success, otherwise failed
+*/
+int waf_mount_add(waf_mount *mount, waf_archive *arc);
+
+/*
+find a file in the mounted archives
+parameters:
+	[in] mount - pointer to a mount
+	[in] filename - name of the file
+	[out] arc - archive holding the file, may be NULL
+returns:
+	entry id of the file in that archive if found
+	otherwise WAF_NO_ID
+*/
+waf_size_t waf_mount_find(waf_mount *mount, const char *filename, waf_archive **arc);
+
+/*
+open a file in the mounted archives
+parameters:
+	[in] mount - pointer to a mount
+	[in] filename - name of the file
+returns:
+	pointer to the file inside the archive if success
+	otherwise failed
+*/
+waf_file* waf_mount_open(waf_mount *mount, const char *filename);
+
+/*
+create a cache of decompressed blocks, it can be shared by archives and threads.
+blocks are found without locking and files read them in place
+parameters:
+	[in] capacity - memory for cached blocks in bytes
+returns:
+	pointer to the cache if success
+	otherwise failed
+*/
+waf_cache* waf_cache_create(waf_size_t capacity);
+
+/*
+create a cache with a second tier of compressed blocks, so a miss in the
+decompressed tier costs an inflate instead of a read. both tiers share the
+capacity, the split follows which tier would have saved more misses
+parameters:
+	[in] capacity - memory for both tiers in bytes
+returns:
+	pointer to the cache if success
+	otherwise failed
+*/
+waf_cache* waf_cache_create_tiered(waf_size_t capacity);
+
+/*
+open a cache in a posix shared memory segment, so processes reading the same
+archives share their decompressed blocks. the first process creates the
+segment, later ones use it at its size, or make it anew if its creator
+died before setting it up. a process crashing mid-write leaves a slot that
+others take over. archives are told apart by the content digest the
+builder stores
+parameters:
+	[in] name - segment name, such as "/game-assets"
+	[in] capacity - segment size for the blocks in bytes, when creating it
+returns:
+	pointer to the cache if success, destroy it to unmap the segment
+	otherwise failed, always on windows
+*/
+waf_cache* waf_cache_open_shared(const char *name, waf_size_t capacity);
+
+/*
+remove a shared memory segment, processes that mapped it keep using it
+parameters:
+	[in] name - segment name
+returns:
+	0 if success, otherwise failed
+*/
+int waf_cache_unlink_shared(const char *name);
+
+/*
+open a cache directory that keeps decompressed blocks across runs, files
+read cached blocks mapped in place. blocks are files named after the
+archive identity and block offset, the least recently used are deleted
+when the directory grows past its capacity. processes may share it
+parameters:
+	[in] dir - cache directory, created if missing
+	[in] capacity - most bytes kept in the directory
+returns:
+	pointer to the cache if success
+	otherwise failed, always on windows
+*/
+waf_cache* waf_cache_open_dir(const char *dir, waf_size_t capacity);
+
+/*
+destroy a cache, once no file reading through it is open
+parameters:
+	[in] cache - pointer to a cache
+*/
+void waf_cache_destroy(waf_cache *cache);
+
+/*
+cache the blocks an archive decompresses, set before opening files
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] cache - pointer to a cache, NULL to stop caching
+returns:
+	= 0    success
+	< 0    a shared or directory cache with an archive that has no content
+	       digest (built by an older waf), the archive is left uncached
+*/
+int waf_archive_set_cache(waf_archive *arc, waf_cache *cache);
+
+/*
+start listing the files whose names begin with a prefix, such as a directory
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] prefix - name prefix, "" lists every file, must stay valid while listing
+	[out] it - enumeration state
+returns:
+	0 if success, otherwise failed
+*/
+int waf_list(waf_archive *arc, const char *prefix, waf_iter *it);
+
+/*
+start listing the files whose names match a pattern
+'*' matches within a directory, '**' across directories (none too when it is
+a whole component), '?' one character and [a-z] or [!a-z] a character class
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] pattern - glob pattern, must stay valid while listing
+	[out] it - enumeration state
+returns:
+	0 if success, otherwise failed
+*/
+int waf_glob(waf_archive *arc, const char *pattern, waf_iter *it);
+
+/*
+move to the next listed file, names come in sorted order
+(in stored order for archives from older builders)
+parameters:
+	[in, out] it - enumeration state, name and size describe the file
+returns:
+	= 0    success
+	= 1    no more files
+	< 0    failed
+*/
+int waf_next(waf_iter *it);
+
+/*
+record the reads of an archive's files to a text file, one line per read:
+microseconds since recording started, position, bytes and entry name.
+give the file to waf -t to lay the files out in the order they were read
+parameters:
+	[in] arc - pointer to an opened archive
+	[in] filename - the trace file, replaced if it exists, NULL to stop recording
+returns:
+	= 0    success
+	< 0    failed
+*/
+int waf_archive_record(waf_archive *arc, const char *filename);
+
+/*
+collect the reader counters. every thread counts on its own and the counts
+are summed here, so they may be a few operations behind threads still reading.
+the counters only grow, diff two calls to measure an interval
+parameters:
+	[out] stats - the totals
+*/
+void waf_archive_stats(waf_stats *stats);
+
+/*
+start recording reader events (opens, reads, seeks, source reads, inflates,
+cache hits and misses) in memory for waf_trace_stop to write out. costs a
+load and a branch per trace point while not recording
+parameters:
+	[in] events - most events kept, later ones are dropped, 0 for the default
+returns:
+	= 0    success
+	< 0    failed, or already recording
+*/
+int waf_trace_start(waf_size_t events);
+
+/*
+stop recording and write the events as chrome trace json, for
+chrome://tracing or perfetto
+parameters:
+	[in] filename - the json file, NULL to discard the events
+returns:
+	number of events written if success
+	< 0    failed, or not recording
+*/
+long waf_trace_stop(const char *filename);
+
+/*
+start the job pool workers, shared by every archive. jobs submitted from a
+worker go to its own deque and idle workers steal them
+parameters:
+	[in] threads - number of workers, 0 for one per processor
+returns:
+	= 0    success
+	= 1    already running, or jobs go to an executor
+	< 0    failed
+*/
+int waf_pool_start(unsigned threads);
+
+/*
+stop the job pool once every submitted job has run, not from a pool job
+*/
+void waf_pool_stop(void);
+
+/*
+send jobs to an existing job system instead of the pool, set before
+starting async reads
+parameters:
+	[in] exec - the job system, NULL to use the pool again
+*/
+void waf_pool_set_executor(const waf_executor *exec);
+
+/*
+run a job on the pool or the executor
+parameters:
+	[in] proc - job procedure
+	[in] arg - passed to the job
+returns:
+	0 if success, otherwise the job was not taken
+*/
+int waf_pool_submit(waf_job_proc proc, void *arg);
+
+/*
+start serving async reads on the job pool, starting the pool if it is not running
+parameters:
+	[in] threads - number of pool workers, 0 for one per processor
+returns:
+	0 if success, otherwise failed
+*/
+int waf_async_start(unsigned threads);
+
+/*
+stop serving async reads, requests still queued complete as cancelled and
+running ones at their next slice. stops the pool if waf_async_start started it
+*/
+void waf_async_stop(void);
+
+/*
+read part of a file on a worker thread. requests run by priority, and a long
+read yields to more urgent requests every WAF_ASYNC_SLICE bytes. archives
+opened with waf_archive_open_io need a read_at that is safe on several threads
+parameters:
+	[in] arc - pointer to an opened archive, kept open until the request completes
+	[in] id - entry id of the file
+	[in] offset - position in the file to read from
+	[out] buff - buffer to hold the data, kept valid until the request completes
+	[in] size - number of bytes to read
+	[in] priority - WAF_PRIORITY_xxx
+	[in] callback - called when the request completes, may be NULL
+	[in] user - passed to the callback
+returns:
+	request handle if success, release it with waf_request_release
+	otherwise failed
+*/
+waf_request* waf_read_async(waf_archive *arc, waf_size_t id, waf_size_t offset, void *buff, waf_size_t size,
+	int priority, waf_read_callback callback, void *user);
+
+/*
+cancel a request. a queued request completes at once on this thread,
+a running one at its next slice
+parameters:
+	[in] req - request handle
+returns:
+	0 if the request had not started, otherwise it completes on a worker
+*/
+int waf_request_cancel(waf_request *req);
+
+/*
+check whether a request has completed
+parameters:
+	[in] req - request handle
+	[out] size - number of bytes read, may be NULL
+returns:
+	WAF_PENDING if still running, otherwise the request result
+*/
+int waf_request_poll(waf_request *req, waf_size_t *size);
+
+/*
+wait for a request to complete
+parameters:
+	[in] req - request handle
+	[out] size - number of bytes read, may be NULL
+returns:
+	= 0    success
+	= WAF_CANCELLED    cancelled
+	< 0    failed
+*/
+int waf_request_wait(waf_request *req, waf_size_t *size);
+
+/*
+release a request handle, the request itself still runs to completion
+parameters:
+	[in] req - request handle
+*/
+void waf_request_release(waf_request *req);
+
 #ifdef __cplusplus
 }  /* extern "C" */
 #endif
@@ -0,0 +1,402 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+/* process-wide work-stealing pool running the reader's jobs */
+
+/* sysconf */
+#ifndef _MSC_VER
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "wafexp.h"
+#include "wafconf.h"
+#include "wafthread.h"
+
+struct waf_job
+{
+	waf_job_proc volatile proc;
+	void *volatile arg;
+};
+
+/*
+per-worker deque (chase-lev), the owner pushes and pops at the bottom
+without locking while other workers steal from the top
+*/
+struct waf_deque
+{
+	volatile unsigned long top;
+	char pad1[WAF_CACHE_LINE - sizeof(unsigned long)];
+	volatile unsigned long bottom;
+	char pad2[WAF_CACHE_LINE - sizeof(unsigned long)];
+	struct waf_job jobs[WAF_POOL_DEQUE];
+};
+
+static struct
+{
+	waf_mutex_t lock;  /* injection queue and sleeping */
+	waf_cond_t wake;
+
+	/* jobs submitted from outside the pool, or by a worker with a full deque */
+	struct waf_job *inject;
+	unsigned long injectcap;
+	unsigned long injecthead;
+	volatile unsigned long injectcount;
+
+	struct waf_deque *deques;
+	waf_thread_t threads[WAF_POOL_MAX_THREADS];
+	unsigned nthreads;
+
+	volatile unsigned long idle;  /* workers sleeping or about to, changed under the lock */
+	volatile unsigned long stopping;
+} waf_pool;
+
+static int waf_pool_started = 0;
+static waf_executor waf_pool_exec;  /* external job system, submit is NULL when unset */
+
+/* index + 1 of the worker running on this thread, 0 elsewhere */
+static WAF_THREAD_LOCAL unsigned waf_pool_self = 0;
+
+static int waf_deque_push(struct waf_deque *dq, waf_job_proc proc, void *arg)
+{
+	unsigned long b = WAF_LOAD_ACQUIRE(dq->bottom);
+	unsigned long t = WAF_LOAD_ACQUIRE(dq->top);
+	struct waf_job *job;
+
+	if ((long)(b - t) >= WAF_POOL_DEQUE)
+		return -1;
+
+	job = &dq->jobs[b & (WAF_POOL_DEQUE - 1)];
+	WAF_STORE_RELEASE(job->proc, proc);
+	WAF_STORE_RELEASE(job->arg, arg);
+	WAF_STORE_RELEASE(dq->bottom, b + 1);
+
+	return 0;
+}
+
+static int waf_deque_pop(struct waf_deque *dq, struct waf_job *out)
+{
+	unsigned long b = WAF_LOAD_ACQUIRE(dq->bottom) - 1;
+	unsigned long t;
+	struct waf_job *job;
+	int found = 1;
+
+	WAF_STORE_RELEASE(dq->bottom, b);
+	WAF_FENCE();
+	t = WAF_LOAD_ACQUIRE(dq->top);
+
+	if ((long)(b - t) < 0)
+	{
+		WAF_STORE_RELEASE(dq->bottom, b + 1);
+		return 0;
+	}
+
+	job = &dq->jobs[b & (WAF_POOL_DEQUE - 1)];
+	out->proc = WAF_LOAD_ACQUIRE(job->proc);
+	out->arg = WAF_LOAD_ACQUIRE(job->arg);
+
+	/* the last job, race the thieves for it */
+	if (b == t)
+	{
+		if (!WAF_CAS(dq->top, t, t + 1))
+			found = 0;
+		WAF_STORE_RELEASE(dq->bottom, b + 1);
+	}
+
+	return found;
+}
+
+static int waf_deque_steal(struct waf_deque *dq, struct waf_job *out)
+{
+	unsigned long t = WAF_LOAD_ACQUIRE(dq->top);
+	unsigned long b;
+	struct waf_job *job;
+
+	WAF_FENCE();
+	b = WAF_LOAD_ACQUIRE(dq->bottom);
+
+	if ((long)(b - t) <= 0)
+		return 0;
+
+	job = &dq->jobs[t & (WAF_POOL_DEQUE - 1)];
+	out->proc = WAF_LOAD_ACQUIRE(job->proc);
+	out->arg = WAF_LOAD_ACQUIRE(job->arg);
+
+	return WAF_CAS(dq->top, t, t + 1);
+}
+
+/* called with the lock held */
+static int waf_inject_push(waf_job_proc proc, void *arg)
+{
+	struct waf_job *jobs;
+	unsigned long cap;
+	unsigned long i;
+
+	if (waf_pool.injectcount == waf_pool.injectcap)
+	{
+		cap = waf_pool.injectcap ? waf_pool.injectcap * 2 : 64;
+		jobs = (struct waf_job*)malloc(sizeof(struct waf_job) * cap);
+		if (!jobs)
+			return -1;
+
+		for (i = 0; i < waf_pool.injectcount; i++)
+			jobs[i] = waf_pool.inject[(waf_pool.injecthead + i) % waf_pool.injectcap];
+
+		free(waf_pool.inject);
+		waf_pool.inject = jobs;
+		waf_pool.injectcap = cap;
+		waf_pool.injecthead = 0;
+	}
+
+	jobs = &waf_pool.inject[(waf_pool.injecthead + waf_pool.injectcount) % waf_pool.injectcap];
+	jobs->proc = proc;
+	jobs->arg = arg;
+	waf_pool.injectcount++;
+
+	return 0;
+}
+
+/* called with the lock held */
+static int waf_inject_pop(struct waf_job *out)
+{
+	if (waf_pool.injectcount == 0)
+		return 0;
+
+	*out = waf_pool.inject[waf_pool.injecthead];
+	waf_pool.injecthead = (waf_pool.injecthead + 1) % waf_pool.injectcap;
+	waf_pool.injectcount--;
+
+	return 1;
+}
+
+static int waf_pool_take(unsigned self, unsigned long *seed, struct waf_job *out)
+{
+	unsigned i;
+	unsigned victim;
+	int found;
+
+	if (waf_deque_pop(&waf_pool.deques[self], out))
+		return 1;
+
+	if (WAF_LOAD_ACQUIRE(waf_pool.injectcount) != 0)
+	{
+		waf_mutex_lock(&waf_pool.lock);
+		found = waf_inject_pop(out);
+		waf_mutex_unlock(&waf_pool.lock);
+		if (found)
+			return 1;
+	}
+
+	/* start at a random victim so thieves spread out */
+	*seed = *seed * 1103515245 + 12345;
+	victim = (unsigned)(*seed >> 16) % waf_pool.nthreads;
+
+	for (i = 0; i < waf_pool.nthreads; i++, victim = (victim + 1) % waf_pool.nthreads)
+	{
+		if (victim != self && waf_deque_steal(&waf_pool.deques[victim], out))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* whether any job is queued, looked at by a worker before it sleeps */
+static int waf_pool_has_work(void)
+{
+	unsigned i;
+
+	if (WAF_LOAD_ACQUIRE(waf_pool.injectcount) != 0)
+		return 1;
+
+	for (i = 0; i < waf_pool.nthreads; i++)
+	{
+		struct waf_deque *dq = &waf_pool.deques[i];
+
+		if ((long)(WAF_LOAD_ACQUIRE(dq->bottom) - WAF_LOAD_ACQUIRE(dq->top)) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static WAF_THREAD_PROC(waf_pool_worker)
+{
+	unsigned self = (unsigned)(size_t)arg;
+	unsigned long seed = self + 1;
+	struct waf_job job;
+
+	waf_pool_self = self + 1;
+
+	for (;;)
+	{
+		if (waf_pool_take(self, &seed, &job))
+		{
+			job.proc(job.arg);
+			continue;
+		}
+
+		/*
+		idle is raised before the queues are looked at once more, and submitters
+		push before looking at idle, so either the job is seen here or its
+		submitter wakes a sleeper
+		*/
+		waf_mutex_lock(&waf_pool.lock);
+		WAF_STORE_RELEASE(waf_pool.idle, waf_pool.idle + 1);
+		WAF_FENCE();
+		if (!waf_pool_has_work())
+		{
+			if (WAF_LOAD_ACQUIRE(waf_pool.stopping))
+			{
+				WAF_STORE_RELEASE(waf_pool.idle, waf_pool.idle - 1);
+				waf_mutex_unlock(&waf_pool.lock);
+				break;
+			}
+			waf_cond_wait(&waf_pool.wake, &waf_pool.lock);
+		}
+		WAF_STORE_RELEASE(waf_pool.idle, waf_pool.idle - 1);
+		waf_mutex_unlock(&waf_pool.lock);
+	}
+
+	waf_pool_self = 0;
+
+	WAF_THREAD_RETURN;
+}
+
+int waf_pool_start(unsigned threads)
+{
+	unsigned i;
+
+	if (waf_pool_started || waf_pool_exec.submit)
+		return 1;
+
+	if (threads == 0)
+		threads = waf_cpu_count();
+	if (threads > WAF_POOL_MAX_THREADS)
+		threads = WAF_POOL_MAX_THREADS;
+
+	memset(&waf_pool, 0, sizeof(waf_pool));
+
+	waf_pool.deques = (struct waf_deque*)malloc(sizeof(struct waf_deque) * threads);
+	if (!waf_pool.deques)
+		return -1;
+	memset(waf_pool.deques, 0, sizeof(struct waf_deque) * threads);
+
+	waf_mutex_init(&waf_pool.lock);
+	waf_cond_init(&waf_pool.wake);
+
+	/* thieves index by nthreads, so it is set before any worker runs */
+	waf_pool.nthreads = threads;
+	for (i = 0; i < threads; i++)
+	{
+		if (waf_thread_create(&waf_pool.threads[i], waf_pool_worker, (void*)(size_t)i) != 0)
+			break;
+	}
+
+	waf_pool_started = 1;
+
+	if (i < threads)
+	{
+		waf_pool.nthreads = i;
+		waf_pool_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+void waf_pool_stop(void)
+{
+	unsigned i;
+
+	if (!waf_pool_started)
+		return;
+
+	/* the workers finish every job before leaving */
+	waf_mutex_lock(&waf_pool.lock);
+	WAF_STORE_RELEASE(waf_pool.stopping, 1);
+	waf_cond_broadcast(&waf_pool.wake);
+	waf_mutex_unlock(&waf_pool.lock);
+
+	for (i = 0; i < waf_pool.nthreads; i++)
+		waf_thread_join(waf_pool.threads[i]);
+
+	waf_cond_destroy(&waf_pool.wake);
+	waf_mutex_destroy(&waf_pool.lock);
+	free(waf_pool.inject);
+	free(waf_pool.deques);
+
+	waf_pool_started = 0;
+}
+
+void waf_pool_set_executor(const waf_executor *exec)
+{
+	if (exec)
+		waf_pool_exec = *exec;
+	else
+		memset(&waf_pool_exec, 0, sizeof(waf_pool_exec));
+}
+
+int waf_pool_submit(waf_job_proc proc, void *arg)
+{
+	unsigned self = waf_pool_self;
+	int status;
+
+	assert(proc != NULL);
+
+	if (waf_pool_exec.submit)
+		return waf_pool_exec.submit(waf_pool_exec.user, proc, arg);
+
+	/* while stopping only running jobs may add more */
+	if (!waf_pool_started || (!self && WAF_LOAD_ACQUIRE(waf_pool.stopping)))
+		return -1;
+
+	if (self && waf_deque_push(&waf_pool.deques[self - 1], proc, arg) == 0)
+	{
+		/* pushed before looking at idle, see waf_pool_worker */
+		WAF_FENCE();
+		if (WAF_LOAD_ACQUIRE(waf_pool.idle) != 0)
+		{
+			waf_mutex_lock(&waf_pool.lock);
+			waf_cond_signal(&waf_pool.wake);
+			waf_mutex_unlock(&waf_pool.lock);
+		}
+		return 0;
+	}
+
+	waf_mutex_lock(&waf_pool.lock);
+	status = waf_inject_push(proc, arg);
+	if (status == 0 && waf_pool.idle != 0)
+		waf_cond_signal(&waf_pool.wake);
+	waf_mutex_unlock(&waf_pool.lock);
+
+	return status;
+}
@@ -0,0 +1,214 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+
+/* reader counters, every thread writes its own set without atomics */
+
+/* clock_gettime */
+#ifndef _MSC_VER
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wafexp.h"
+#include "wafconf.h"
+#include "wafthread.h"
+#include "wafstats.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/*
+counters of the threads using the reader. a thread's counts are folded
+into waf_stats_retired when it exits, and its slot is reused
+*/
+static waf_stats *waf_stats_threads[WAF_STATS_THREADS];
+static unsigned char waf_stats_used[WAF_STATS_THREADS];
+static waf_stats waf_stats_retired;
+
+/* shared by threads past WAF_STATS_THREADS running at once, their updates may race and lose counts */
+static waf_stats waf_stats_shared;
+
+/* guards the slots, taken when a thread starts or exits and when the counts are summed */
+static volatile unsigned long waf_stats_lock = 0;
+
+static waf_tls_t waf_stats_key;
+static int waf_stats_keyed = 0;  /* -1 if the key could not be created */
+
+static WAF_THREAD_LOCAL waf_stats *waf_stats_self = NULL;
+
+static void waf_stats_acquire(void)
+{
+	unsigned long expected = 0;
+
+	while (!WAF_CAS(waf_stats_lock, expected, 1))
+	{
+		expected = 0;
+		waf_thread_yield();
+	}
+}
+
+static void waf_stats_release(void)
+{
+	WAF_STORE_RELEASE(waf_stats_lock, 0);
+}
+
+static void waf_stats_add(waf_stats *total, const waf_stats *stats)
+{
+	const waf_size_t *from = (const waf_size_t*)stats;
+	waf_size_t *to = (waf_size_t*)total;
+	size_t i;
+
+	/* the struct is all counters */
+	for (i = 0; i < sizeof(waf_stats) / sizeof(waf_size_t); i++)
+		to[i] += from[i];
+}
+
+/* a thread that used the reader is exiting */
+static WAF_TLS_DTOR(waf_stats_exit)
+{
+	waf_stats *stats = (waf_stats*)value;
+	unsigned i;
+
+	waf_stats_acquire();
+	for (i = 0; i < WAF_STATS_THREADS; i++)
+	{
+		if (waf_stats_threads[i] == stats && waf_stats_used[i])
+		{
+			waf_stats_add(&waf_stats_retired, stats);
+			memset(stats, 0, sizeof(waf_stats));
+			waf_stats_used[i] = 0;
+			break;
+		}
+	}
+	waf_stats_release();
+
+	/* a later destructor on this thread reading files takes a slot again */
+	waf_stats_self = NULL;
+}
+
+waf_stats* waf_stats_local(void)
+{
+	waf_stats *stats = waf_stats_self;
+	unsigned i;
+
+	if (stats)
+		return stats;
+
+	stats = &waf_stats_shared;
+
+	waf_stats_acquire();
+
+	if (waf_stats_keyed == 0)
+		waf_stats_keyed = waf_tls_create(&waf_stats_key, waf_stats_exit) == 0 ? 1 : -1;
+
+	/* without the key slots are never given back, sharing beats running out */
+	for (i = 0; waf_stats_keyed > 0 && i < WAF_STATS_THREADS; i++)
+	{
+		if (waf_stats_used[i])
+			continue;
+
+		if (!waf_stats_threads[i])
+		{
+			waf_stats_threads[i] = (waf_stats*)malloc(sizeof(waf_stats));
+			if (!waf_stats_threads[i])
+				break;
+			memset(waf_stats_threads[i], 0, sizeof(waf_stats));
+		}
+
+		waf_stats_used[i] = 1;
+		stats = waf_stats_threads[i];
+		waf_tls_set(waf_stats_key, stats);
+		break;
+	}
+
+	waf_stats_release();
+
+	waf_stats_self = stats;
+	return stats;
+}
+
+waf_size_t waf_clock(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	/* split to keep the product in range */
+	return (waf_size_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+		(waf_size_t)(now.QuadPart % freq.QuadPart) * 1000000000 / (waf_size_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (waf_size_t)ts.tv_sec * 1000000000 + (waf_size_t)ts.tv_nsec;
+#endif
+}
+
+waf_size_t waf_stats_time(waf_stats *stats, int op, waf_size_t start)
+{
+	waf_size_t elapsed = waf_clock() - start;
+	waf_size_t rest = elapsed;
+	int bucket = 0;
+
+	while (rest > 1 && bucket < WAF_STATS_BUCKETS - 1)
+	{
+		rest >>= 1;
+		bucket++;
+	}
+
+	stats->latency[op][bucket]++;
+
+	return elapsed;
+}
+
+void waf_archive_stats(waf_stats *stats)
+{
+	unsigned i;
+
+	memset(stats, 0, sizeof(waf_stats));
+
+	waf_stats_acquire();
+	for (i = 0; i < WAF_STATS_THREADS; i++)
+	{
+		if (waf_stats_used[i])
+			waf_stats_add(stats, waf_stats_threads[i]);
+	}
+	waf_stats_add(stats, &waf_stats_retired);
+	waf_stats_release();
+
+	waf_stats_add(stats, &waf_stats_shared);
+}
@@ -0,0 +1,47 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+
+/* per-thread reader counters, summed by waf_archive_stats */
+
+#ifndef __WAF_STATS_H__
+#define __WAF_STATS_H__
+
+#include "wafexp.h"
+
+/* counters of the calling thread */
+waf_stats* waf_stats_local(void);
+
+/* monotonic time in nanoseconds */
+waf_size_t waf_clock(void);
+
+/* count an operation that started at start, returns how long it took */
+waf_size_t waf_stats_time(waf_stats *stats, int op, waf_size_t start);
+
+#endif  /* __WAF_STATS_H__ */
@@ -0,0 +1,128 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+/* threads, locks and condition variables for the reader's workers */
+
+#ifndef __WAF_THREAD_H__
+#define __WAF_THREAD_H__
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+/* condition variables need windows vista or later, the processor count windows 7 */
+typedef CRITICAL_SECTION waf_mutex_t;
+typedef CONDITION_VARIABLE waf_cond_t;
+typedef HANDLE waf_thread_t;
+
+#define WAF_THREAD_PROC(name) DWORD WINAPI name(LPVOID arg)
+#define WAF_THREAD_RETURN return 0
+
+#define waf_mutex_init(m) InitializeCriticalSection(m)
+#define waf_mutex_destroy(m) DeleteCriticalSection(m)
+#define waf_mutex_lock(m) EnterCriticalSection(m)
+#define waf_mutex_unlock(m) LeaveCriticalSection(m)
+
+#define waf_cond_init(c) InitializeConditionVariable(c)
+#define waf_cond_destroy(c) ((void)(c))
+#define waf_cond_wait(c,m) SleepConditionVariableCS((c), (m), INFINITE)
+#define waf_cond_signal(c) WakeConditionVariable(c)
+#define waf_cond_broadcast(c) WakeAllConditionVariable(c)
+
+#define waf_thread_create(t,proc,arg) ((*(t) = CreateThread(NULL, 0, (proc), (arg), 0, NULL)) != NULL ? 0 : -1)
+#define waf_thread_join(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+#define waf_thread_yield() SwitchToThread()
+
+/* thread-local value handed to a destructor when its thread exits (fiber local storage) */
+typedef DWORD waf_tls_t;
+
+#define WAF_TLS_DTOR(name) void WINAPI name(void *value)
+#define waf_tls_create(k,dtor) ((*(k) = FlsAlloc(dtor)) != FLS_OUT_OF_INDEXES ? 0 : -1)
+#define waf_tls_set(k,v) FlsSetValue((k), (v))
+
+/* atomics on unsigned long (32-bit here), add returns the new value, expected is a variable */
+#define WAF_CAS(var,expected,desired) (InterlockedCompareExchange((volatile LONG*)&(var), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#define WAF_ATOMIC_ADD(var,n) ((unsigned long)InterlockedExchangeAdd((volatile LONG*)&(var), (LONG)(n)) + (unsigned long)(n))
+#define WAF_FENCE() MemoryBarrier()
+
+#ifdef _MSC_VER
+#define WAF_THREAD_LOCAL __declspec(thread)
+#else
+#define WAF_THREAD_LOCAL __thread
+#endif
+
+#define waf_cpu_count() ((unsigned)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS))
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+typedef pthread_mutex_t waf_mutex_t;
+typedef pthread_cond_t waf_cond_t;
+typedef pthread_t waf_thread_t;
+
+#define WAF_THREAD_PROC(name) void* name(void *arg)
+#define WAF_THREAD_RETURN return NULL
+
+#define waf_mutex_init(m) pthread_mutex_init((m), NULL)
+#define waf_mutex_destroy(m) pthread_mutex_destroy(m)
+#define waf_mutex_lock(m) pthread_mutex_lock(m)
+#define waf_mutex_unlock(m) pthread_mutex_unlock(m)
+
+#define waf_cond_init(c) pthread_cond_init((c), NULL)
+#define waf_cond_destroy(c) pthread_cond_destroy(c)
+#define waf_cond_wait(c,m) pthread_cond_wait((c), (m))
+#define waf_cond_signal(c) pthread_cond_signal(c)
+#define waf_cond_broadcast(c) pthread_cond_broadcast(c)
+
+#define waf_thread_create(t,proc,arg) (pthread_create((t), NULL, (proc), (arg)) == 0 ? 0 : -1)
+#define waf_thread_join(t) pthread_join((t), NULL)
+#define waf_thread_yield() sched_yield()
+
+/* thread-local value handed to a destructor when its thread exits */
+typedef pthread_key_t waf_tls_t;
+
+#define WAF_TLS_DTOR(name) void name(void *value)
+#define waf_tls_create(k,dtor) (pthread_key_create((k), (dtor)) == 0 ? 0 : -1)
+#define waf_tls_set(k,v) pthread_setspecific((k), (v))
+
+/* atomics on unsigned long, add returns the new value, expected is a variable and may be overwritten */
+#define WAF_CAS(var,expected,desired) __atomic_compare_exchange_n(&(var), &(expected), (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+#define WAF_ATOMIC_ADD(var,n) __atomic_add_fetch(&(var), (n), __ATOMIC_SEQ_CST)
+#define WAF_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define WAF_THREAD_LOCAL __thread
+
+#define waf_cpu_count() (sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (unsigned)sysconf(_SC_NPROCESSORS_ONLN) : 1u)
+
+#endif
+
+#endif  /* __WAF_THREAD_H__ */
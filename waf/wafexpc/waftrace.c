@@ -0,0 +1,205 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+
+/* in-memory event recorder, written out as chrome trace json */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wafexp.h"
+#include "wafconf.h"
+#include "wafthread.h"
+#include "wafstats.h"
+#include "waftrace.h"
+
+#ifdef _WIN32
+#define waf_getpid() ((unsigned long)GetCurrentProcessId())
+#else
+#include <unistd.h>
+#define waf_getpid() ((unsigned long)getpid())
+#endif
+
+struct waf_trace_event
+{
+	volatile int event;  /* event + 1 once the rest is written */
+	unsigned long tid;
+	waf_size_t start;
+	waf_size_t end;
+	waf_size_t a;
+	waf_size_t b;
+};
+
+/* names of the events and their arguments */
+static const char *const waf_event_names[WAF_EVENT_COUNT][3] =
+{
+	{ "open", "id", "size" },
+	{ "read", "position", "bytes" },
+	{ "seek", "position", "walks" },
+	{ "io", "position", "bytes" },
+	{ "inflate", "compressed", "inflated" },
+	{ "cache hit", "offset", "tier" },
+	{ "cache miss", "offset", NULL }
+};
+
+volatile int waf_tracing = 0;
+
+static struct
+{
+	struct waf_trace_event *events;
+	unsigned long capacity;
+	volatile unsigned long next;  /* reserved events, may run past capacity */
+	volatile unsigned long writers;  /* threads between the tracing check and the end of their event */
+	waf_size_t base;  /* clock at start */
+} waf_trace;
+
+static volatile unsigned long waf_trace_threads = 0;
+static WAF_THREAD_LOCAL unsigned long waf_trace_tid = 0;
+
+void waf_trace_event(int event, waf_size_t start, waf_size_t a, waf_size_t b)
+{
+	struct waf_trace_event *ev;
+	unsigned long i;
+
+	WAF_ATOMIC_ADD(waf_trace.writers, 1);
+
+	/* the recorder may have stopped since the caller looked */
+	if (WAF_LOAD_ACQUIRE(waf_tracing))
+	{
+		i = WAF_ATOMIC_ADD(waf_trace.next, 1) - 1;
+		if (i < waf_trace.capacity)
+		{
+			if (!waf_trace_tid)
+				waf_trace_tid = WAF_ATOMIC_ADD(waf_trace_threads, 1);
+
+			ev = &waf_trace.events[i];
+			ev->tid = waf_trace_tid;
+			ev->end = waf_clock();
+			ev->start = start ? start : ev->end;
+			ev->a = a;
+			ev->b = b;
+			WAF_STORE_RELEASE(ev->event, event + 1);
+		}
+	}
+
+	WAF_ATOMIC_ADD(waf_trace.writers, (unsigned long)-1);
+}
+
+int waf_trace_start(waf_size_t events)
+{
+	if (waf_tracing || waf_trace.events)
+		return -1;
+
+	if (events == 0)
+		events = WAF_TRACE_EVENTS;
+
+	waf_trace.events = (struct waf_trace_event*)malloc(sizeof(struct waf_trace_event) * (size_t)events);
+	if (!waf_trace.events)
+		return -1;
+	memset(waf_trace.events, 0, sizeof(struct waf_trace_event) * (size_t)events);
+
+	waf_trace.capacity = (unsigned long)events;
+	waf_trace.next = 0;
+	waf_trace.base = waf_clock();
+
+	WAF_STORE_RELEASE(waf_tracing, 1);
+	return 0;
+}
+
+/* microseconds since the start, doubles keep the output plain c89 */
+static double waf_trace_us(waf_size_t t)
+{
+	return t > waf_trace.base ? (double)(t - waf_trace.base) / 1000.0 : 0.0;
+}
+
+long waf_trace_stop(const char *filename)
+{
+	struct waf_trace_event *ev;
+	const char *const *names;
+	unsigned long count;
+	unsigned long pid = waf_getpid();
+	unsigned long i;
+	long written = 0;
+	FILE *fp = NULL;
+
+	if (!waf_trace.events)
+		return -1;
+
+	/* wait out the events being written */
+	WAF_STORE_RELEASE(waf_tracing, 0);
+	WAF_FENCE();
+	while (WAF_LOAD_ACQUIRE(waf_trace.writers) != 0)
+		waf_thread_yield();
+
+	count = waf_trace.next < waf_trace.capacity ? waf_trace.next : waf_trace.capacity;
+
+	if (filename)
+	{
+		fp = fopen(filename, "w");
+		if (!fp)
+			written = -1;
+	}
+
+	if (fp)
+	{
+		fprintf(fp, "{\"traceEvents\":[\n");
+
+		for (i = 0; i < count; i++)
+		{
+			ev = &waf_trace.events[i];
+			if (ev->event == 0)
+				continue;
+
+			names = waf_event_names[ev->event - 1];
+			fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"waf\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,",
+				written ? ",\n" : "", names[0], pid, ev->tid, waf_trace_us(ev->start));
+
+			if (ev->event - 1 >= WAF_EVENT_HIT)
+				fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+			else
+				fprintf(fp, "\"ph\":\"X\",\"dur\":%.3f,", (double)(ev->end - ev->start) / 1000.0);
+
+			fprintf(fp, "\"args\":{\"%s\":%.0f", names[1], (double)ev->a);
+			if (names[2])
+				fprintf(fp, ",\"%s\":%.0f", names[2], (double)ev->b);
+			fprintf(fp, "}}");
+			written++;
+		}
+
+		fprintf(fp, "\n],\"otherData\":{\"dropped\":%lu}}\n", waf_trace.next - count);
+		if (fclose(fp) != 0)
+			written = -1;
+	}
+
+	free(waf_trace.events);
+	waf_trace.events = NULL;
+
+	return written;
+}
@@ -0,0 +1,79 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+
+/*
+trace points on the reader's hot paths. each one is a USDT probe when the
+reader is built with WAF_USDT (linux, needs sys/sdt.h from systemtap), a nop
+until perf or bpftrace attaches, and an event for the recorder while
+waf_trace_start is in effect, a load and a branch otherwise
+*/
+
+#ifndef __WAF_TRACE_H__
+#define __WAF_TRACE_H__
+
+#include "wafexp.h"
+
+/* recorded events */
+#define WAF_EVENT_OPEN 0  /* span, entry id and size */
+#define WAF_EVENT_READ 1  /* span, position and bytes */
+#define WAF_EVENT_SEEK 2  /* span, position and block headers walked */
+#define WAF_EVENT_IO 3  /* span, source position and bytes */
+#define WAF_EVENT_INFLATE 4  /* span, compressed and inflated bytes */
+#define WAF_EVENT_HIT 5  /* instant, block offset and cache tier */
+#define WAF_EVENT_MISS 6  /* instant, block offset */
+#define WAF_EVENT_COUNT 7
+
+/* cache tiers of a hit */
+#define WAF_TIER_HOT 0
+#define WAF_TIER_COLD 1
+#define WAF_TIER_SHARED 2
+#define WAF_TIER_DISK 3
+
+#if defined(WAF_USDT) && !defined(_WIN32)
+#include <sys/sdt.h>
+#define WAF_PROBE1(name,a) DTRACE_PROBE1(waf, name, a)
+#define WAF_PROBE2(name,a,b) DTRACE_PROBE2(waf, name, a, b)
+#define WAF_PROBE3(name,a,b,c) DTRACE_PROBE3(waf, name, a, b, c)
+#else
+#define WAF_PROBE1(name,a) ((void)0)
+#define WAF_PROBE2(name,a,b) ((void)0)
+#define WAF_PROBE3(name,a,b,c) ((void)0)
+#endif
+
+/* nonzero while the recorder runs */
+extern volatile int waf_tracing;
+
+/* record a span from start (waf_clock) to now, or an instant */
+#define WAF_TRACE_SPAN(event,start,a,b) (waf_tracing ? waf_trace_event((event), (start), (a), (b)) : (void)0)
+#define WAF_TRACE_MARK(event,a,b) (waf_tracing ? waf_trace_event((event), 0, (a), (b)) : (void)0)
+
+void waf_trace_event(int event, waf_size_t start, waf_size_t a, waf_size_t b);
+
+#endif  /* __WAF_TRACE_H__ */
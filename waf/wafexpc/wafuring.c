@@ -0,0 +1,486 @@
+/*
+
+WANE's Archive File Explorer
+Copyright (c) 2010-2011 wane. All rights reserved.
+
+This software is provided 'as-is', without any express or
+implied warranty. In no event will the authors be held liable
+for any damages arising from the use of this software. 
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you
+must not claim that you wrote the original software. If you use
+this software in a product, an acknowledgment in the product
+documentation would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software. 
+
+3. This notice may not be removed or altered from any source
+distribution.
+
+wane <newsheep@gmail.com>
+
+*/
+
+
+/* archive source on linux io_uring, batched reads into registered buffers */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wafexp.h"
+#include "wafconf.h"
+
+#if defined(__linux__) && !defined(WAF_NO_IO_URING)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* one ring, used by one batch at a time */
+struct waf_uring_ring
+{
+	int fd;
+	int fixed;  /* arena registered with this ring */
+	struct waf_uring_ring *next;  /* next free ring */
+
+	unsigned entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/*
+batches on several threads each take a ring of their own, so they overlap
+in the kernel instead of waiting on each other for one ring
+*/
+struct waf_uring
+{
+	int fd;  /* archive file */
+	pthread_mutex_t lock;  /* free list and ring count */
+	struct waf_uring_ring *free;  /* rings no batch is using */
+	unsigned rings;  /* rings created */
+	unsigned maxrings;  /* 0 when the kernel does not offer io_uring */
+
+	unsigned char *arena;  /* registered buffers, NULL if there is no ring or no memory */
+	unsigned slots;  /* bit per arena buffer in use */
+};
+
+static waf_size_t waf_uring_read_at(void *user, waf_size_t pos, void *buff, waf_size_t len)
+{
+	struct waf_uring *u = (struct waf_uring*)user;
+	waf_size_t done = 0;
+
+	while (done < len)
+	{
+		ssize_t got = pread(u->fd, (char*)buff + done, (size_t)(len - done), (off_t)(pos + done));
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+
+		done += (waf_size_t)got;
+	}
+
+	return done;
+}
+
+static waf_size_t waf_uring_size(void *user)
+{
+	struct waf_uring *u = (struct waf_uring*)user;
+	struct stat st;
+
+	if (fstat(u->fd, &st) != 0)
+		return 0;
+
+	return (waf_size_t)st.st_size;
+}
+
+static int waf_uring_enter(int ring, unsigned submit, unsigned wait)
+{
+	return (int)syscall(__NR_io_uring_enter, ring, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static void waf_uring_ring_close(struct waf_uring_ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	free(r);
+}
+
+/* set up a ring, NULL if the kernel does not offer io_uring */
+static struct waf_uring_ring* waf_uring_ring_create(struct waf_uring *u)
+{
+	struct waf_uring_ring *r;
+	struct io_uring_params p;
+	struct iovec iov;
+	void *mem;
+	int ring;
+
+	memset(&p, 0, sizeof(p));
+	ring = (int)syscall(__NR_io_uring_setup, WAF_URING_ENTRIES, &p);
+	if (ring < 0)
+		return NULL;
+
+	r = (struct waf_uring_ring*)malloc(sizeof(struct waf_uring_ring));
+	if (!r)
+	{
+		close(ring);
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct waf_uring_ring));
+
+	r->fd = ring;
+	r->entries = p.sq_entries;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	mem = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if (mem == MAP_FAILED)
+		goto __error;
+	r->sq_ring = mem;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else
+	{
+		mem = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		if (mem == MAP_FAILED)
+			goto __error;
+		r->cq_ring = mem;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	mem = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (mem == MAP_FAILED)
+		goto __error;
+	r->sqes = (struct io_uring_sqe*)mem;
+
+	r->sq_head = (unsigned*)((char*)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned*)((char*)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned*)((char*)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)((char*)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned*)((char*)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned*)((char*)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned*)((char*)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cq_ring + p.cq_off.cqes);
+
+	/* every ring registers the arena, a ring that can't reads it like any other buffer */
+	if (u->arena)
+	{
+		iov.iov_base = u->arena;
+		iov.iov_len = WAF_URING_SLOTS * WAF_WINDOW_SIZE;
+		r->fixed = syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+	}
+
+	return r;
+
+__error:
+	waf_uring_ring_close(r);
+	return NULL;
+}
+
+/* a free ring, or a new one while there are fewer than WAF_URING_RINGS, NULL if none */
+static struct waf_uring_ring* waf_uring_get(struct waf_uring *u)
+{
+	struct waf_uring_ring *r;
+
+	pthread_mutex_lock(&u->lock);
+	r = u->free;
+	if (r)
+		u->free = r->next;
+	else if (u->rings < u->maxrings)
+		u->rings++;
+	else
+	{
+		pthread_mutex_unlock(&u->lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	if (!r)
+	{
+		/* set up outside the lock, the other batches go on meanwhile */
+		r = waf_uring_ring_create(u);
+		if (!r)
+		{
+			pthread_mutex_lock(&u->lock);
+			u->rings--;
+			pthread_mutex_unlock(&u->lock);
+		}
+	}
+
+	return r;
+}
+
+static void waf_uring_put(struct waf_uring *u, struct waf_uring_ring *r)
+{
+	pthread_mutex_lock(&u->lock);
+	r->next = u->free;
+	u->free = r;
+	pthread_mutex_unlock(&u->lock);
+}
+
+static int waf_uring_batch(void *user, waf_io_req *reqs, waf_size_t count)
+{
+	struct waf_uring *u = (struct waf_uring*)user;
+	struct waf_uring_ring *r;
+	waf_size_t next = 0;  /* next request to queue */
+	waf_size_t done = 0;
+	unsigned pending = 0;  /* queued, not submitted */
+	unsigned inflight = 0;
+	int failed = 0;
+
+	/* without a ring to spare, read with pread like a source without io_uring */
+	r = waf_uring_get(u);
+	if (!r)
+	{
+		for (; next < count; next++)
+		{
+			if (waf_uring_read_at(u, reqs[next].pos, reqs[next].buff, reqs[next].len) != reqs[next].len)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	/*
+	the kernel writes into the buffers until a request completes, so on
+	failure stop queueing, but reap everything submitted before returning.
+	stray completions would otherwise land in the buffers of later batches
+	*/
+	while (done < count && !(failed && inflight == 0))
+	{
+		unsigned tail = *r->sq_tail;
+		unsigned head;
+		int ret;
+
+		/* queue as many requests as the ring takes */
+		while (!failed && next < count && inflight < r->entries)
+		{
+			struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+			unsigned char *buff = (unsigned char*)reqs[next].buff;
+			int fixed = r->fixed && buff >= u->arena && buff + reqs[next].len <= u->arena + WAF_URING_SLOTS * WAF_WINDOW_SIZE;
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+			sqe->fd = u->fd;
+			sqe->off = reqs[next].pos;
+			sqe->addr = (unsigned long)buff;
+			sqe->len = (unsigned)reqs[next].len;
+			sqe->buf_index = 0;
+			sqe->user_data = next;
+
+			r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+			tail++;
+			next++;
+			pending++;
+			inflight++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+		ret = waf_uring_enter(r->fd, pending, 1);
+		if (ret >= 0)
+			pending -= (unsigned)ret;
+		else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			/* nothing was submitted, take back what the kernel has not seen and wait for the rest */
+			unsigned unseen = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+			__atomic_store_n(r->sq_tail, tail - unseen, __ATOMIC_RELEASE);
+			inflight -= unseen;
+			pending = 0;
+			failed = 1;
+		}
+
+		/* completions, short or refused reads are finished with pread */
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			waf_size_t got = cqe->res > 0 ? (waf_size_t)cqe->res : 0;
+			waf_io_req *req;
+
+			head++;
+			if (cqe->user_data >= next)
+			{
+				failed = 1;  /* not one of ours */
+				continue;
+			}
+			inflight--;
+
+			req = &reqs[cqe->user_data];
+			if (got < req->len && waf_uring_read_at(u, req->pos + got, (char*)req->buff + got, req->len - got) != req->len - got)
+				failed = 1;
+
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	waf_uring_put(u, r);
+
+	return failed ? -1 : 0;
+}
+
+/* window buffers come from the registered arena while it has room */
+static void* waf_uring_alloc(void *user, waf_size_t size)
+{
+	struct waf_uring *u = (struct waf_uring*)user;
+	unsigned slots;
+	unsigned i;
+
+	if (u->arena && size <= WAF_WINDOW_SIZE)
+	{
+		slots = __atomic_load_n(&u->slots, __ATOMIC_RELAXED);
+		for (i = 0; i < WAF_URING_SLOTS; i++)
+		{
+			if (!(slots & (1u << i)) && !(__atomic_fetch_or(&u->slots, 1u << i, __ATOMIC_ACQUIRE) & (1u << i)))
+				return u->arena + (size_t)i * WAF_WINDOW_SIZE;
+		}
+	}
+
+	return malloc((size_t)size);
+}
+
+static void waf_uring_free(void *user, void *ptr)
+{
+	struct waf_uring *u = (struct waf_uring*)user;
+	unsigned char *p = (unsigned char*)ptr;
+
+	if (u->arena && p >= u->arena && p < u->arena + WAF_URING_SLOTS * WAF_WINDOW_SIZE)
+		__atomic_fetch_and(&u->slots, ~(1u << ((p - u->arena) / WAF_WINDOW_SIZE)), __ATOMIC_RELEASE);
+	else
+		free(ptr);
+}
+
+static void waf_uring_close(void *user)
+{
+	struct waf_uring *u = (struct waf_uring*)user;
+	struct waf_uring_ring *r;
+
+	/* no batch is running, every ring is free */
+	while ((r = u->free) != NULL)
+	{
+		u->free = r->next;
+		waf_uring_ring_close(r);
+	}
+
+	if (u->arena)
+		munmap(u->arena, WAF_URING_SLOTS * WAF_WINDOW_SIZE);
+
+	pthread_mutex_destroy(&u->lock);
+	close(u->fd);
+	free(u);
+}
+
+/* set up the first ring, more come as batches overlap, maxrings stays 0 if the kernel does not offer io_uring */
+static void waf_uring_setup(struct waf_uring *u)
+{
+	struct waf_uring_ring *r;
+
+	/* registered buffers skip mapping the pages on every read, optional when memlock is short */
+	u->arena = (unsigned char*)mmap(NULL, WAF_URING_SLOTS * WAF_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->arena == MAP_FAILED)
+		u->arena = NULL;
+
+	r = waf_uring_ring_create(u);
+	if (!r || !r->fixed)
+	{
+		if (u->arena)
+			munmap(u->arena, WAF_URING_SLOTS * WAF_WINDOW_SIZE);
+		u->arena = NULL;
+	}
+	if (!r)
+		return;
+
+	u->free = r;
+	u->rings = 1;
+	u->maxrings = WAF_URING_RINGS;
+}
+
+struct waf_archive* waf_archive_open_uring(const char *filename, waf_size_t offset)
+{
+	struct waf_archive *arc;
+	struct waf_uring *u;
+	waf_io io;
+
+	u = (struct waf_uring*)malloc(sizeof(struct waf_uring));
+	if (!u)
+		return NULL;
+	memset(u, 0, sizeof(struct waf_uring));
+
+	u->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (u->fd < 0)
+	{
+		free(u);
+		return NULL;
+	}
+
+	pthread_mutex_init(&u->lock, NULL);
+	waf_uring_setup(u);
+
+	memset(&io, 0, sizeof(io));
+	io.user = u;
+	io.read_at = waf_uring_read_at;
+	io.size = waf_uring_size;
+	io.close = waf_uring_close;
+	io.read_batch = waf_uring_batch;
+	io.alloc = waf_uring_alloc;
+	io.free = waf_uring_free;
+
+	arc = waf_archive_open_io(&io, offset);
+	if (!arc)
+		waf_uring_close(u);
+
+	return arc;
+}
+
+#else
+
+struct waf_archive* waf_archive_open_uring(const char *filename, waf_size_t offset)
+{
+	return waf_archive_open(filename, offset);
+}
+
+#endif